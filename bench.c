@@ -0,0 +1,366 @@
+/*
+ * Microbenchmarks for the per packet paths: building and parsing a
+ * packet (send_buf/recv_buf without the socket), in_cksum, the
+ * Server's out of order buffering and drain, and rCopy's loadData.
+ * Packets go over an in memory link instead of a socket, so only
+ * the code is timed. Run with "make bench".
+ * The reorder benchmark runs the Server's receive path, reorderArrive,
+ * with a copy out standing in for the Disk Thread's Ring.
+ */
+#include <time.h>
+
+#include "networks.h"
+#include "ring.h"
+#include "window.h"
+#include "reorder.h"
+
+//How long each benchmark runs for (msec) unless given on the command line
+#define DEFAULT_BENCH_MSEC 200
+
+//Packets in one pass of the reorder benchmark, and the Windows they arrive into
+#define REORDER_PACKETS (1 << 20)
+#define REORDER_WINDOW 128
+#define REORDER_BIG_WINDOW 131072
+
+//Packets a burst loses, and how often one starts
+#define BURST_LEN 8
+#define BURST_EVERY 200
+
+//Struct Declaration for the Mock Link: packets handed from the sending side to the receiving side
+typedef struct {
+	uint8_t *packets;
+	int32_t *lens;
+	uint32_t depth;
+	uint32_t head;
+	uint32_t tail;
+} Link;
+
+//Struct Declaration for what a Benchmark works on
+typedef struct {
+	int32_t bufSize;
+	uint8_t *buf;
+	uint8_t *packet;
+	Link link;
+	Window *winBuf;
+	int32_t windowSize;
+	int32_t *order;
+	int32_t orderLen;
+	int32_t next;
+	int32_t base;
+	int32_t expected;
+	Reorder reorder;
+	Outlet outlet;
+	Pool *pool;
+	Ring ring;
+	uint32_t seqNum;
+} Bench;
+
+//A Benchmark does count operations and returns how long the part worth timing took (nsec)
+typedef uint64_t (*BenchFn)(Bench *bench, uint64_t count);
+
+//Keeps the compiler from throwing the work away
+static volatile uint64_t sink = 0;
+static uint8_t *sinkBuf = NULL;
+
+//Function Headers
+uint64_t timeNowNs(void);
+void runBench(char *name, Bench *bench, BenchFn fn, int32_t bytesPerOp, uint64_t targetNs);
+void linkInit(Link *link, uint32_t depth);
+void linkFree(Link *link);
+uint64_t benchCksum(Bench *bench, uint64_t count);
+uint64_t benchBuild(Bench *bench, uint64_t count);
+uint64_t benchParse(Bench *bench, uint64_t count);
+uint64_t benchLink(Bench *bench, uint64_t count);
+uint64_t benchReorder(Bench *bench, uint64_t count);
+uint64_t benchLoad(Bench *bench, uint64_t count);
+int32_t makeOrder(int32_t *order, int32_t len, int32_t windowSize, double loss, int32_t burst);
+int32_t sinkOne(void *arg, uint8_t *buf, int32_t len, uint8_t flag);
+int32_t sinkRun(void *arg, Reorder *reorder, int32_t seqNum, uint32_t count);
+
+
+int main(int argc, char *argv[]) {
+	int32_t sizes[] = {MIN_BUF_LEN, 1400, 8192, MAX_BUF_LEN};
+	int32_t windows[] = {REORDER_WINDOW, REORDER_BIG_WINDOW};
+	double losses[] = {0, 0.01, 0.05};
+	char name[64];
+	uint64_t targetNs = DEFAULT_BENCH_MSEC * 1000000ULL;
+	int32_t index = 0, loss = 0, window = 0;
+	Bench bench;
+
+	if (argc > 2) {
+		printf("Usage: %s [msec per benchmark]\n", argv[0]);
+		exit(-1);
+	}
+	if (argc == 2) {
+		if (atoi(argv[1]) < 1) {
+			printf("Invalid time. (Must be at least 1 ms)\n");
+			exit(-1);
+		}
+		targetNs = atoi(argv[1]) * 1000000ULL;
+	}
+	if ((sinkBuf = malloc(MAX_BUF_LEN)) == NULL) {
+		perror("bench, malloc");
+		exit(-1);
+	}
+	memset(&bench, 0, sizeof(bench));
+	printf("%-24s %6s %12s %12s\n", "benchmark", "size", "ns/op", "MB/s");
+
+	for (index = 0; index < sizeof(sizes) / sizeof(sizes[0]); index++) {
+		bench.bufSize = sizes[index];
+		bench.buf = malloc(bench.bufSize);
+		bench.packet = malloc(bench.bufSize + HEADER_LEN);
+		if (bench.buf == NULL || bench.packet == NULL) {
+			perror("bench, malloc");
+			exit(-1);
+		}
+		memset(bench.buf, 0xA5, bench.bufSize);
+		linkInit(&bench.link, 64);
+		buildPacket(bench.buf, bench.bufSize, DATA_FLAG, 1, bench.packet);
+
+		runBench("in_cksum", &bench, benchCksum, bench.bufSize + HEADER_LEN, targetNs);
+		runBench("build (send_buf)", &bench, benchBuild, bench.bufSize, targetNs);
+		buildPacket(bench.buf, bench.bufSize, DATA_FLAG, 1, bench.packet);
+		runBench("parse (recv_buf)", &bench, benchParse, bench.bufSize, targetNs);
+		runBench("build+parse over link", &bench, benchLink, bench.bufSize, targetNs);
+
+		//loadData copies a Ring slot into the Window; the Ring is refilled outside the timing
+		if (ringInit(&bench.ring, DEFAULT_RING_DEPTH, bench.bufSize) < 0) {
+			perror("bench, ringInit");
+			exit(-1);
+		}
+		bench.windowSize = DEFAULT_RING_DEPTH;
+		bench.winBuf = windowAlloc(bench.windowSize, bench.bufSize);
+		runBench("loadData", &bench, benchLoad, bench.bufSize, targetNs);
+		windowFree(bench.winBuf);
+		ringFree(&bench.ring);
+
+		linkFree(&bench.link);
+		free(bench.packet);
+		free(bench.buf);
+	}
+
+	//Buffering and draining as the Server does it, for a few loss patterns
+	bench.bufSize = 1400;
+	bench.buf = malloc(bench.bufSize);
+	bench.order = malloc(REORDER_PACKETS * sizeof(int32_t));
+	if (bench.buf == NULL || bench.order == NULL) {
+		perror("bench, malloc");
+		exit(-1);
+	}
+	memset(bench.buf, 0xA5, bench.bufSize);
+	//Held packets borrow from the Pool, as they do in the Server
+	bench.pool = poolInit((uint64_t) DEFAULT_POOL_MB << 20);
+	bench.outlet.one = sinkOne;
+	bench.outlet.run = sinkRun;
+	bench.outlet.arg = NULL;
+	for (window = 0; window < sizeof(windows) / sizeof(windows[0]); window++) {
+		bench.windowSize = windows[window];
+		for (loss = 0; loss <= sizeof(losses) / sizeof(losses[0]); loss++) {
+			if (loss < sizeof(losses) / sizeof(losses[0])) {
+				bench.orderLen = makeOrder(bench.order, REORDER_PACKETS, bench.windowSize, losses[loss], 0);
+				snprintf(name, sizeof(name), "reorder w%d %.0f%% loss", bench.windowSize, losses[loss] * 100);
+			}
+			else {
+				bench.orderLen = makeOrder(bench.order, REORDER_PACKETS, bench.windowSize, 0, 1);
+				snprintf(name, sizeof(name), "reorder w%d burst", bench.windowSize);
+			}
+			reorderInit(&bench.reorder, bench.pool, bench.windowSize, bench.bufSize);
+			bench.next = 0;
+			bench.base = 1;
+			bench.expected = 1;
+			runBench(name, &bench, benchReorder, bench.bufSize, targetNs);
+			reorderFree(&bench.reorder);
+		}
+	}
+	free(bench.order);
+	free(bench.buf);
+	free(sinkBuf);
+	return 0;
+}
+
+uint64_t timeNowNs(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//Double the count until a run takes long enough to trust, then report that run
+void runBench(char *name, Bench *bench, BenchFn fn, int32_t bytesPerOp, uint64_t targetNs) {
+	uint64_t count = 1, elapsed = 0;
+
+	for (;;) {
+		elapsed = fn(bench, count);
+		if (elapsed >= targetNs || count >= (1ULL << 40)) {
+			break;
+		}
+		//Jump most of the way there once the run is long enough to extrapolate from
+		count = (elapsed > targetNs / 16) ? count * targetNs / elapsed + 1 : count * 2;
+	}
+	printf("%-24s %6d %12.1f %12.1f\n", name, bench->bufSize, (double) elapsed / count,
+		(double) bytesPerOp * count * 1000.0 / elapsed);
+}
+
+void linkInit(Link *link, uint32_t depth) {
+	link->depth = depth;
+	link->head = 0;
+	link->tail = 0;
+	link->packets = malloc((size_t) depth * (MAX_BUF_LEN + HEADER_LEN));
+	link->lens = malloc(depth * sizeof(int32_t));
+	if (link->packets == NULL || link->lens == NULL) {
+		perror("linkInit, malloc");
+		exit(-1);
+	}
+}
+
+void linkFree(Link *link) {
+	free(link->packets);
+	free(link->lens);
+}
+
+uint64_t benchCksum(Bench *bench, uint64_t count) {
+	uint64_t sum = 0, start = timeNowNs();
+
+	for (; count > 0; count--) {
+		sum += in_cksum((unsigned short *) bench->packet, bench->bufSize + HEADER_LEN);
+	}
+	sink += sum;
+	return timeNowNs() - start;
+}
+
+uint64_t benchBuild(Bench *bench, uint64_t count) {
+	uint64_t sum = 0, start = timeNowNs();
+
+	for (; count > 0; count--) {
+		sum += buildPacket(bench->buf, bench->bufSize, DATA_FLAG, (uint32_t) count, bench->packet);
+	}
+	sink += sum + bench->packet[4];
+	return timeNowNs() - start;
+}
+
+uint64_t benchParse(Bench *bench, uint64_t count) {
+	uint64_t sum = 0, start = timeNowNs();
+	uint8_t flag = 0;
+	int32_t seqNum = 0;
+
+	for (; count > 0; count--) {
+		sum += parsePacket(bench->packet, bench->bufSize + HEADER_LEN, sinkBuf, &flag, &seqNum);
+	}
+	sink += sum + flag + seqNum;
+	return timeNowNs() - start;
+}
+
+//A packet each way through the Mock Link: built into the next slot, then parsed back out
+uint64_t benchLink(Bench *bench, uint64_t count) {
+	Link *link = &bench->link;
+	uint8_t *packet = NULL;
+	uint64_t sum = 0, start = timeNowNs();
+	uint8_t flag = 0;
+	int32_t seqNum = 0, slot = 0;
+
+	for (; count > 0; count--) {
+		slot = link->head++ % link->depth;
+		link->lens[slot] = buildPacket(bench->buf, bench->bufSize, DATA_FLAG, link->head, link->packets +
+			(size_t) slot * (MAX_BUF_LEN + HEADER_LEN));
+
+		slot = link->tail++ % link->depth;
+		packet = link->packets + (size_t) slot * (MAX_BUF_LEN + HEADER_LEN);
+		sum += parsePacket(packet, link->lens[slot], sinkBuf, &flag, &seqNum);
+	}
+	sink += sum + seqNum;
+	return timeNowNs() - start;
+}
+
+//Play the arrival order over and over. seqNums keep climbing, so the Window never needs resetting.
+uint64_t benchReorder(Bench *bench, uint64_t count) {
+	uint64_t start = timeNowNs();
+
+	for (; count > 0; count--) {
+		reorderArrive(&bench->reorder, &bench->outlet, &bench->expected, bench->base + bench->order[bench->next],
+			bench->buf, bench->bufSize, DATA_FLAG);
+		if (++bench->next == bench->orderLen) {
+			bench->next = 0;
+			bench->base += REORDER_PACKETS;
+		}
+	}
+	sink += bench->expected;
+	return timeNowNs() - start;
+}
+
+//In order data is copied out where the Server would hand it to the Disk Thread
+int32_t sinkOne(void *arg, uint8_t *buf, int32_t len, uint8_t flag) {
+	memcpy(sinkBuf, buf, len);
+	return 0;
+}
+
+//Likewise a run of held packets, as the Server's deliverRun does into the Ring
+int32_t sinkRun(void *arg, Reorder *reorder, int32_t seqNum, uint32_t count) {
+	uint32_t index = 0;
+	Held *slot = NULL;
+
+	for (index = 0; index < count; index++) {
+		slot = reorderSlot(reorder, seqNum + index);
+		memcpy(sinkBuf, slot->buf, slot->len);
+	}
+	reorderRelease(reorder, seqNum, count);
+	return 0;
+}
+
+//Fill the Ring as the Disk Thread would (not timed), then time loading it into the Window
+uint64_t benchLoad(Bench *bench, uint64_t count) {
+	RingSlot *slot = NULL;
+	uint64_t start = 0, elapsed = 0, sum = 0;
+	uint32_t batch = 0;
+
+	while (count > 0) {
+		for (batch = 0; batch < count && (slot = ringProduce(&bench->ring)) != NULL; batch++) {
+			slot->seqNum = 0;
+			slot->buf_len = bench->bufSize;
+			slot->flag = DATA_FLAG;
+			ringPublish(&bench->ring);
+		}
+		start = timeNowNs();
+		for (; batch > 0; batch--, count--) {
+			sum += loadData(bench->winBuf, &bench->ring, bench->windowSize, &bench->seqNum);
+		}
+		elapsed += timeNowNs() - start;
+	}
+	sink += sum;
+	return elapsed;
+}
+
+//Order packets arrive in when each one lost turns up again half a Window later, the way a
+//resend after an SREJ does. Returns how many arrivals that makes.
+int32_t makeOrder(int32_t *order, int32_t len, int32_t windowSize, double loss, int32_t burst) {
+	int32_t seqNum = 0, count = 0, index = 0, late = 0;
+	int32_t *pending = malloc(len * sizeof(int32_t));
+	int32_t *due = malloc(len * sizeof(int32_t));
+	uint32_t state = 0x2545F491;
+
+	if (pending == NULL || due == NULL) {
+		perror("makeOrder, malloc");
+		exit(-1);
+	}
+	for (seqNum = 0; seqNum < len; seqNum++) {
+		//Resends that are due go out ahead of new data
+		while (index < late && due[index] <= count) {
+			order[count++] = pending[index++];
+		}
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		if ((burst && seqNum % BURST_EVERY < BURST_LEN) || (!burst && state < loss * 4294967296.0)) {
+			pending[late] = seqNum;
+			due[late++] = count + windowSize / 2;
+		}
+		else {
+			order[count++] = seqNum;
+		}
+	}
+	while (index < late) {
+		order[count++] = pending[index++];
+	}
+	free(pending);
+	free(due);
+	return count;
+}
@@ -0,0 +1,201 @@
+/*
+ * Content defined Chunks and the Server's Chunk store. Both ends
+ * cut a file the same way (FastCDC), so a Chunk the Server wrote
+ * for one file can be copied out of the store for the next one
+ * instead of crossing the network again.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "networks.h"
+#include "hash.h"
+#include "chunk.h"
+
+//Bits of the rolling hash that must be clear for a cut. Harder to hit below CHUNK_AVG,
+//easier past it, so Chunk sizes bunch up around the average (FastCDC normalised chunking).
+#define MASK_SMALL 0x0003590703530000ULL
+#define MASK_LARGE 0x0000d90003530000ULL
+
+//Longest path into the store: directory, '/', two hex digits a byte, and the temp suffix
+#define CHUNK_PATH_LEN (MAX_LEN + 2 * CHUNK_ID_LEN + 64)
+
+static uint64_t gear[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+
+static void gearInit(void);
+static void chunkPath(char *path, char *store, const uint8_t *id);
+static void chunkerStore(Chunker *chunker, uint32_t len);
+
+//Gear table from splitmix64, so both ends build the same one without shipping it
+static void gearInit(void) {
+	uint64_t state = 0, value = 0;
+	int32_t index = 0;
+
+	for (index = 0; index < 256; index++) {
+		state += 0x9E3779B97F4A7C15ULL;
+		value = state;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+		gear[index] = value ^ (value >> 31);
+	}
+}
+
+//Length of the first Chunk in buf. Only looks at CHUNK_MAX bytes, so the cut
+//doesn't depend on how much was buffered after it.
+uint32_t chunkCut(const uint8_t *buf, uint32_t len) {
+	uint64_t fingerprint = 0;
+	uint32_t index = CHUNK_MIN;
+	uint32_t normal = CHUNK_AVG, end = CHUNK_MAX;
+
+	pthread_once(&gearOnce, gearInit);
+	if (len <= CHUNK_MIN) {
+		return len;
+	}
+	end = len < end ? len : end;
+	normal = end < normal ? end : normal;
+	for (; index < normal; index++) {
+		fingerprint = (fingerprint << 1) + gear[buf[index]];
+		if (!(fingerprint & MASK_SMALL)) {
+			return index + 1;
+		}
+	}
+	for (; index < end; index++) {
+		fingerprint = (fingerprint << 1) + gear[buf[index]];
+		if (!(fingerprint & MASK_LARGE)) {
+			return index + 1;
+		}
+	}
+	return end;
+}
+
+void chunkId(const uint8_t *buf, uint32_t len, uint8_t *id) {
+	ShaState state;
+
+	shaInit(&state);
+	shaUpdate(&state, buf, len);
+	shaDigest(&state, id);
+}
+
+//Each Chunk is a file in the store named by its ID in hex
+static void chunkPath(char *path, char *store, const uint8_t *id) {
+	int32_t index = 0;
+
+	path += sprintf(path, "%s/", store);
+	for (index = 0; index < CHUNK_ID_LEN; index++) {
+		path += sprintf(path, "%02x", id[index]);
+	}
+}
+
+int32_t chunkHave(char *store, const uint8_t *id) {
+	char path[CHUNK_PATH_LEN];
+
+	chunkPath(path, store, id);
+	return access(path, R_OK) == 0;
+}
+
+//Add a Chunk to the store. Written under a temporary name and renamed, so a Chunk
+//is never seen half written. The store is only a cache; failing to add to it isn't an error.
+void chunkPut(char *store, const uint8_t *id, const uint8_t *buf, uint32_t len) {
+	static uint32_t count = 0;
+	char path[CHUNK_PATH_LEN], temp[CHUNK_PATH_LEN];
+	int32_t fd = 0;
+
+	if (chunkHave(store, id)) {
+		return;
+	}
+	chunkPath(path, store, id);
+	snprintf(temp, sizeof(temp), "%s/.tmp.%d.%u", store, getpid(), count++);
+	if ((fd = open(temp, O_CREAT | O_EXCL | O_WRONLY, 0444)) < 0) {
+		return;
+	}
+	if (write(fd, buf, len) != len || close(fd) < 0 || rename(temp, path) < 0) {
+		unlink(temp);
+	}
+}
+
+//Append a stored Chunk to dataFile. copy_file_range lets the file system share the blocks
+//(a reflink) where it can; anything else gets plain writes. buf gets the Chunk too, to be hashed.
+//Returns -1 if the store doesn't hold a Chunk of that length and ID. One of the right length that
+//doesn't match its ID has been damaged; it's removed, so nobody is offered it again.
+int32_t chunkCopy(char *store, const uint8_t *id, uint8_t *buf, uint32_t len, int32_t dataFile) {
+	char path[CHUNK_PATH_LEN];
+	uint8_t check[CHUNK_ID_LEN];
+	struct stat info;
+	int32_t fd = 0;
+	loff_t from = 0;
+	ssize_t copied = 0;
+	uint32_t done = 0;
+
+	chunkPath(path, store, id);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &info) < 0 || info.st_size != len || pread(fd, buf, len, 0) != len) {
+		close(fd);
+		return -1;
+	}
+	chunkId(buf, len, check);
+	if (memcmp(check, id, CHUNK_ID_LEN) != 0) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	while (done < len && (copied = copy_file_range(fd, &from, dataFile, NULL, len - done, 0)) > 0) {
+		done += copied;
+	}
+	close(fd);
+	if (done < len && write(dataFile, buf + done, len - done) != len - done) {
+		perror("write Error");
+		exit(-1);
+	}
+	return len;
+}
+
+void chunkerInit(Chunker *chunker, char *store) {
+	chunker->start = 0;
+	chunker->len = 0;
+	chunker->store = store;
+}
+
+//Take what was just written. Cuts Chunks only once CHUNK_MAX bytes are held,
+//since until then a boundary could still move.
+void chunkerFeed(Chunker *chunker, const uint8_t *buf, uint32_t len) {
+	uint32_t take = 0;
+
+	while (len > 0) {
+		if (chunker->start + chunker->len == sizeof(chunker->buf)) {
+			memmove(chunker->buf, chunker->buf + chunker->start, chunker->len);
+			chunker->start = 0;
+		}
+		take = sizeof(chunker->buf) - chunker->start - chunker->len;
+		take = len < take ? len : take;
+		memcpy(chunker->buf + chunker->start + chunker->len, buf, take);
+		chunker->len += take;
+		buf += take;
+		len -= take;
+		while (chunker->len >= CHUNK_MAX) {
+			chunkerStore(chunker, chunkCut(chunker->buf + chunker->start, chunker->len));
+		}
+	}
+}
+
+//Something other than data comes next (a hole, a stored Chunk, the end). rCopy cuts there too.
+void chunkerFlush(Chunker *chunker) {
+	while (chunker->len > 0) {
+		chunkerStore(chunker, chunkCut(chunker->buf + chunker->start, chunker->len));
+	}
+	chunker->start = 0;
+}
+
+//Store the next len bytes as a Chunk. Runt Chunks before a cut aren't worth a reference.
+static void chunkerStore(Chunker *chunker, uint32_t len) {
+	uint8_t id[CHUNK_ID_LEN];
+	uint8_t *buf = chunker->buf + chunker->start;
+
+	if (len >= CHUNK_MIN) {
+		chunkId(buf, len, id);
+		chunkPut(chunker->store, id, buf, len);
+	}
+	chunker->start += len;
+	chunker->len -= len;
+}
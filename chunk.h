@@ -0,0 +1,50 @@
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <stdint.h>
+
+#include "hash.h"
+
+//Content Defined Chunk Sizes (FastCDC). A boundary depends only on the bytes since the last one,
+//so an edit early in a file doesn't move the Chunks after it.
+#define CHUNK_MIN 2048
+#define CHUNK_AVG 8192
+#define CHUNK_MAX 65536
+
+//Bytes rCopy reads ahead and cuts into Chunks at a time
+#define CHUNK_POOL (1 << 20)
+
+//Bytes in a Chunk's ID: the SHA-256 of its data. rCopy's word for what a Chunk holds is taken as is,
+//so it mustn't be possible to make two Chunks with one ID.
+#define CHUNK_ID_LEN SHA_LEN
+
+//Chunks asked about in one CHUNK_QUERY. CHUNK_HAVE answers with a bit each.
+#define CHUNK_BATCH 64
+#define CHUNK_BITMAP_LEN (CHUNK_BATCH / 8)
+
+//How long rCopy waits on a CHUNK_HAVE (msec), and how often it asks before sending the data anyway
+#define CHUNK_WAIT 200
+#define CHUNK_TRIES 3
+
+//Payload of a CHUNK_REF packet: the ID, then the length (network order)
+#define CHUNK_REF_LEN (CHUNK_ID_LEN + 4)
+
+//Struct Declaration for the Server's Streaming Chunker.
+//Holds what was written until it can be sure where the next boundary is, then stores the Chunk.
+typedef struct {
+	uint8_t buf[2 * CHUNK_MAX];
+	uint32_t start;
+	uint32_t len;
+	char *store;
+} Chunker;
+
+//Headers for Functions in chunk.c
+uint32_t chunkCut(const uint8_t *buf, uint32_t len);
+void chunkId(const uint8_t *buf, uint32_t len, uint8_t *id);
+int32_t chunkHave(char *store, const uint8_t *id);
+void chunkPut(char *store, const uint8_t *id, const uint8_t *buf, uint32_t len);
+int32_t chunkCopy(char *store, const uint8_t *id, uint8_t *buf, uint32_t len, int32_t dataFile);
+void chunkerInit(Chunker *chunker, char *store);
+void chunkerFeed(Chunker *chunker, const uint8_t *buf, uint32_t len);
+void chunkerFlush(Chunker *chunker);
+#endif
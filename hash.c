@@ -0,0 +1,254 @@
+/*
+ * Streaming XXH64 hash of a whole file. rCopy hashes what it
+ * reads and the Server hashes what it writes, a buffer at a
+ * time, so checking the copy never rereads either file.
+ * SHA-256 too, for Chunk IDs, where a collision could be made on purpose.
+ */
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+#define PRIME_4 0x85EBCA77C2B2AE63ULL
+#define PRIME_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t value, int32_t bits);
+static uint64_t read64(const uint8_t *buf);
+static uint32_t read32(const uint8_t *buf);
+static uint64_t round64(uint64_t lane, uint64_t input);
+static uint64_t mergeRound(uint64_t acc, uint64_t lane);
+static void consumeStripe(HashState *state, const uint8_t *buf);
+static uint32_t rotr(uint32_t value, int32_t bits);
+static void consumeBlock(ShaState *state, const uint8_t *buf);
+
+static const uint32_t shaRounds[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint64_t rotl(uint64_t value, int32_t bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+//Input is read little endian no matter the host
+static uint64_t read64(const uint8_t *buf) {
+	return (uint64_t) read32(buf) | ((uint64_t) read32(buf + 4) << 32);
+}
+
+static uint32_t read32(const uint8_t *buf) {
+	return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) | ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static uint64_t round64(uint64_t lane, uint64_t input) {
+	lane += input * PRIME_2;
+	lane = rotl(lane, 31);
+	return lane * PRIME_1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t lane) {
+	acc ^= round64(0, lane);
+	return acc * PRIME_1 + PRIME_4;
+}
+
+static void consumeStripe(HashState *state, const uint8_t *buf) {
+	state->lanes[0] = round64(state->lanes[0], read64(buf));
+	state->lanes[1] = round64(state->lanes[1], read64(buf + 8));
+	state->lanes[2] = round64(state->lanes[2], read64(buf + 16));
+	state->lanes[3] = round64(state->lanes[3], read64(buf + 24));
+}
+
+//Seed 0
+void hashInit(HashState *state) {
+	state->lanes[0] = PRIME_1 + PRIME_2;
+	state->lanes[1] = PRIME_2;
+	state->lanes[2] = 0;
+	state->lanes[3] = -PRIME_1;
+	state->totalLen = 0;
+	state->stripeLen = 0;
+}
+
+//Feed the next len bytes. A partial stripe is kept until the next call fills it.
+void hashUpdate(HashState *state, const uint8_t *buf, uint32_t len) {
+	uint32_t fill = 0;
+
+	state->totalLen += len;
+	if (state->stripeLen > 0) {
+		fill = HASH_STRIPE - state->stripeLen;
+		if (len < fill) {
+			memcpy(state->stripe + state->stripeLen, buf, len);
+			state->stripeLen += len;
+			return;
+		}
+		memcpy(state->stripe + state->stripeLen, buf, fill);
+		consumeStripe(state, state->stripe);
+		buf += fill;
+		len -= fill;
+		state->stripeLen = 0;
+	}
+	while (len >= HASH_STRIPE) {
+		consumeStripe(state, buf);
+		buf += HASH_STRIPE;
+		len -= HASH_STRIPE;
+	}
+	memcpy(state->stripe, buf, len);
+	state->stripeLen = len;
+}
+
+//Feed len zero bytes, for a hole that was never read or written
+void hashZeros(HashState *state, uint64_t len) {
+	static const uint8_t zeros[4096];
+	uint32_t chunk = 0;
+
+	while (len > 0) {
+		chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+		hashUpdate(state, zeros, chunk);
+		len -= chunk;
+	}
+}
+
+//Digest of everything fed so far, big endian so both ends compare bytes
+void hashDigest(HashState *state, uint8_t *digest) {
+	uint64_t hash = 0;
+	uint8_t *tail = state->stripe;
+	uint32_t left = state->stripeLen;
+	int32_t index = 0;
+
+	if (state->totalLen >= HASH_STRIPE) {
+		hash = rotl(state->lanes[0], 1) + rotl(state->lanes[1], 7) + rotl(state->lanes[2], 12) + rotl(state->lanes[3], 18);
+		for (index = 0; index < 4; index++) {
+			hash = mergeRound(hash, state->lanes[index]);
+		}
+	}
+	else {
+		hash = state->lanes[2] + PRIME_5;
+	}
+	hash += state->totalLen;
+
+	while (left >= 8) {
+		hash ^= round64(0, read64(tail));
+		hash = rotl(hash, 27) * PRIME_1 + PRIME_4;
+		tail += 8;
+		left -= 8;
+	}
+	if (left >= 4) {
+		hash ^= (uint64_t) read32(tail) * PRIME_1;
+		hash = rotl(hash, 23) * PRIME_2 + PRIME_3;
+		tail += 4;
+		left -= 4;
+	}
+	while (left > 0) {
+		hash ^= (uint64_t) *tail * PRIME_5;
+		hash = rotl(hash, 11) * PRIME_1;
+		tail++;
+		left--;
+	}
+	hash ^= hash >> 33;
+	hash *= PRIME_2;
+	hash ^= hash >> 29;
+	hash *= PRIME_3;
+	hash ^= hash >> 32;
+
+	for (index = 0; index < HASH_LEN; index++) {
+		digest[index] = (uint8_t) (hash >> (8 * (HASH_LEN - 1 - index)));
+	}
+}
+
+static uint32_t rotr(uint32_t value, int32_t bits) {
+	return (value >> bits) | (value << (32 - bits));
+}
+
+//One 64 byte block. SHA-256 reads its input big endian.
+static void consumeBlock(ShaState *state, const uint8_t *buf) {
+	uint32_t schedule[64], work[8], mix1 = 0, mix0 = 0;
+	int32_t index = 0;
+
+	for (index = 0; index < 16; index++) {
+		schedule[index] = ((uint32_t) buf[4 * index] << 24) | ((uint32_t) buf[4 * index + 1] << 16) |
+			((uint32_t) buf[4 * index + 2] << 8) | (uint32_t) buf[4 * index + 3];
+	}
+	for (; index < 64; index++) {
+		mix0 = rotr(schedule[index - 15], 7) ^ rotr(schedule[index - 15], 18) ^ (schedule[index - 15] >> 3);
+		mix1 = rotr(schedule[index - 2], 17) ^ rotr(schedule[index - 2], 19) ^ (schedule[index - 2] >> 10);
+		schedule[index] = schedule[index - 16] + mix0 + schedule[index - 7] + mix1;
+	}
+	memcpy(work, state->words, sizeof(work));
+	for (index = 0; index < 64; index++) {
+		mix1 = work[7] + (rotr(work[4], 6) ^ rotr(work[4], 11) ^ rotr(work[4], 25)) +
+			((work[4] & work[5]) ^ (~work[4] & work[6])) + shaRounds[index] + schedule[index];
+		mix0 = (rotr(work[0], 2) ^ rotr(work[0], 13) ^ rotr(work[0], 22)) +
+			((work[0] & work[1]) ^ (work[0] & work[2]) ^ (work[1] & work[2]));
+		memmove(work + 1, work, 7 * sizeof(uint32_t));
+		work[4] += mix1;
+		work[0] = mix1 + mix0;
+	}
+	for (index = 0; index < 8; index++) {
+		state->words[index] += work[index];
+	}
+}
+
+void shaInit(ShaState *state) {
+	static const uint32_t start[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(state->words, start, sizeof(start));
+	state->totalLen = 0;
+	state->blockLen = 0;
+}
+
+//Feed the next len bytes. A partial block is kept until the next call fills it.
+void shaUpdate(ShaState *state, const uint8_t *buf, uint32_t len) {
+	uint32_t fill = 0;
+
+	state->totalLen += len;
+	if (state->blockLen > 0) {
+		fill = SHA_BLOCK - state->blockLen;
+		if (len < fill) {
+			memcpy(state->block + state->blockLen, buf, len);
+			state->blockLen += len;
+			return;
+		}
+		memcpy(state->block + state->blockLen, buf, fill);
+		consumeBlock(state, state->block);
+		buf += fill;
+		len -= fill;
+		state->blockLen = 0;
+	}
+	while (len >= SHA_BLOCK) {
+		consumeBlock(state, buf);
+		buf += SHA_BLOCK;
+		len -= SHA_BLOCK;
+	}
+	memcpy(state->block, buf, len);
+	state->blockLen = len;
+}
+
+//Pad with a 1 bit, zeros, and the length in bits, then write the words out big endian
+void shaDigest(ShaState *state, uint8_t *digest) {
+	uint64_t bits = state->totalLen * 8;
+	int32_t index = 0;
+
+	state->block[state->blockLen++] = 0x80;
+	if (state->blockLen > SHA_BLOCK - 8) {
+		memset(state->block + state->blockLen, 0, SHA_BLOCK - state->blockLen);
+		consumeBlock(state, state->block);
+		state->blockLen = 0;
+	}
+	memset(state->block + state->blockLen, 0, SHA_BLOCK - 8 - state->blockLen);
+	for (index = 0; index < 8; index++) {
+		state->block[SHA_BLOCK - 1 - index] = (uint8_t) (bits >> (8 * index));
+	}
+	consumeBlock(state, state->block);
+
+	for (index = 0; index < SHA_LEN; index++) {
+		digest[index] = (uint8_t) (state->words[index / 4] >> (8 * (3 - index % 4)));
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+
+//Bytes of Digest carried at the end of the EOF packet
+#define HASH_LEN 8
+
+//XXH64 works on 32 byte stripes, four lanes at a time
+#define HASH_STRIPE 32
+
+//SHA-256 Digest and block lengths. Used where a Digest has to hold up against someone choosing the data.
+#define SHA_LEN 32
+#define SHA_BLOCK 64
+
+//Struct Declaration for a Streaming XXH64 Hash
+typedef struct {
+	uint64_t lanes[4];
+	uint64_t totalLen;
+	uint8_t stripe[HASH_STRIPE];
+	uint32_t stripeLen;
+} HashState;
+
+//Struct Declaration for a Streaming SHA-256 Hash
+typedef struct {
+	uint32_t words[8];
+	uint64_t totalLen;
+	uint8_t block[SHA_BLOCK];
+	uint32_t blockLen;
+} ShaState;
+
+//Headers for Functions in hash.c
+void hashInit(HashState *state);
+void hashUpdate(HashState *state, const uint8_t *buf, uint32_t len);
+void hashZeros(HashState *state, uint64_t len);
+void hashDigest(HashState *state, uint8_t *digest);
+void shaInit(ShaState *state);
+void shaUpdate(ShaState *state, const uint8_t *buf, uint32_t len);
+void shaDigest(ShaState *state, uint8_t *digest);
+#endif
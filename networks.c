@@ -5,6 +5,12 @@
  */
 #include "cpe464.h"
 #include "networks.h"
+#include "trace.h"
+
+static int32_t send_packet(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num,
+	uint8_t *packet);
+static int32_t recv_packet(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection,
+	uint8_t *flag, int32_t *seq_num, int recvFlags);
 
 
 int32_t udpSetup (int portNum) {
@@ -56,6 +62,137 @@ int32_t udp_client_setup (char *hostname, uint16_t portNum, Connection *connecti
 	return 0;
 }
 
+int32_t isMulticast(struct sockaddr_in *addr) {
+	return IN_MULTICAST(ntohl(addr->sin_addr.s_addr));
+}
+
+//Receiver side of a Multicast group. Several receivers may share the port.
+int32_t mcastSetup(char *group, int portNum, char *iface) {
+	int sk = 0, on = 1;
+	struct sockaddr_in local;
+	struct ip_mreq mreq;
+
+	if ((sk = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("mcast -> socket");
+		exit(-1);
+	}
+	if (setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		perror("mcast -> SO_REUSEADDR");
+		exit(-1);
+	}
+
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = INADDR_ANY;
+	local.sin_port = htons(portNum);
+
+	if (bindMod(sk, (struct sockaddr *) &local, sizeof(local)) < 0) {
+		perror("mcast -> bind");
+		exit(-1);
+	}
+
+	if (inet_aton(group, &mreq.imr_multiaddr) == 0 || !IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))) {
+		printf("Not a multicast group: %s\n", group);
+		exit(-1);
+	}
+	mreq.imr_interface.s_addr = INADDR_ANY;
+	if (iface != NULL && inet_aton(iface, &mreq.imr_interface) == 0) {
+		printf("Bad interface address: %s\n", iface);
+		exit(-1);
+	}
+	if (setsockopt(sk, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		perror("mcast -> IP_ADD_MEMBERSHIP");
+		exit(-1);
+	}
+
+	printf("Joined %s on Port Number: %d\n", group, portNum);
+	return sk;
+}
+
+//Sender side of a Multicast group
+void mcastSenderSetup(Connection *connection, char *iface) {
+	struct in_addr ifaceAddr;
+	unsigned char ttl = MC_TTL, loop = 1;
+
+	if (iface != NULL) {
+		if (inet_aton(iface, &ifaceAddr) == 0) {
+			printf("Bad interface address: %s\n", iface);
+			exit(-1);
+		}
+		if (setsockopt(connection->sk_num, IPPROTO_IP, IP_MULTICAST_IF, &ifaceAddr, sizeof(ifaceAddr)) < 0) {
+			perror("mcast -> IP_MULTICAST_IF");
+			exit(-1);
+		}
+	}
+	//Loop lets receivers on this host (and loopback tests) hear the group
+	setsockopt(connection->sk_num, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(connection->sk_num, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+}
+
+int32_t sameAddr(struct sockaddr_in *first, struct sockaddr_in *second) {
+	return first->sin_addr.s_addr == second->sin_addr.s_addr && first->sin_port == second->sin_port;
+}
+
+//Grow the socket buffers to hold a whole Window. The kernel may give less; never shrink them.
+//Linux reports back (and charges datagrams against) twice what was asked for.
+void sizeSocket(int32_t socketNum, int64_t bytes) {
+	int32_t current = 0, size = 0;
+	socklen_t optLen = sizeof(current);
+
+	//Each datagram costs well over its length in kernel bookkeeping.
+	//Big Windows would overflow what setsockopt takes; ask for the most it can and let the kernel cap it.
+	bytes *= 2;
+	size = bytes < INT_MAX ? bytes : INT_MAX;
+	if (getsockopt(socketNum, SOL_SOCKET, SO_RCVBUF, &current, &optLen) == 0 && current / 2 < size) {
+		setsockopt(socketNum, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	optLen = sizeof(current);
+	if (getsockopt(socketNum, SOL_SOCKET, SO_SNDBUF, &current, &optLen) == 0 && current / 2 < size) {
+		setsockopt(socketNum, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+}
+
+//Window slots share one block of bufSize payload buffers
+Window *windowAlloc(int32_t windowSize, int32_t bufSize) {
+	Window *winBuf = calloc(windowSize, sizeof(Window));
+	uint8_t *payload = malloc((size_t) windowSize * bufSize);
+	int32_t index = 0;
+
+	if (winBuf == NULL || payload == NULL) {
+		perror("windowAlloc");
+		exit(-1);
+	}
+	for (index = 0; index < windowSize; index++) {
+		winBuf[index].buf = payload + (size_t) index * bufSize;
+	}
+	return winBuf;
+}
+
+void windowFree(Window *winBuf) {
+	if (winBuf != NULL) {
+		free(winBuf[0].buf);
+		free(winBuf);
+	}
+}
+
+//Length of a hole, as carried in a HOLE_FLAG packet
+void putHoleLen(uint8_t *buf, uint64_t len) {
+	int32_t index = 0;
+
+	for (index = 0; index < HOLE_LEN_SIZE; index++) {
+		buf[index] = (uint8_t) (len >> (8 * (HOLE_LEN_SIZE - 1 - index)));
+	}
+}
+
+uint64_t getHoleLen(uint8_t *buf) {
+	uint64_t len = 0;
+	int32_t index = 0;
+
+	for (index = 0; index < HOLE_LEN_SIZE; index++) {
+		len = (len << 8) | buf[index];
+	}
+	return len;
+}
+
 int32_t selectCall (int32_t socketNum, int32_t seconds, int32_t microseconds, int32_t setNull) {
 	fd_set fdvar;
 	struct timeval aTimeout;
@@ -83,6 +220,32 @@ int32_t selectCall (int32_t socketNum, int32_t seconds, int32_t microseconds, in
 	}
 }
 
+//Select across two sockets. Returns bit 1 if first is ready, bit 2 if second is.
+int32_t selectPair(int32_t first, int32_t second, int32_t seconds, int32_t microseconds) {
+	fd_set fdvar;
+	struct timeval aTimeout;
+	int32_t ready = 0;
+
+	aTimeout.tv_sec = seconds;
+	aTimeout.tv_usec = microseconds;
+
+	FD_ZERO(&fdvar);
+	FD_SET(first, &fdvar);
+	FD_SET(second, &fdvar);
+
+	if (selectMod((first > second ? first : second) + 1, (fd_set *) &fdvar, (fd_set *) 0, (fd_set *) 0, &aTimeout) < 0) {
+		perror("select");
+		exit(-1);
+	}
+	if (FD_ISSET(first, &fdvar)) {
+		ready |= 1;
+	}
+	if (FD_ISSET(second, &fdvar)) {
+		ready |= 2;
+	}
+	return ready;
+}
+
 int processSelect(Connection *client, int *retryCount, int selectTimeoutState, int dataReadyState, int doneState) {
 	int returnValue = dataReadyState;
 
@@ -104,40 +267,88 @@ int processSelect(Connection *client, int *retryCount, int selectTimeoutState, i
 	return returnValue;
 }
 
+//packet must hold len + HEADER_LEN bytes
 int32_t send_buf(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num, uint8_t *packet) {
 	int32_t sentLen = 0;
+
+	if ((sentLen = send_packet(buf, len, connection, flag, seq_num, packet)) < 0) {
+		perror("send_buf, sendto");
+		exit(-1);
+	}
+	return sentLen;
+}
+
+//Same as send_buf, but hands a failed send (e.g. EMSGSIZE) back with errno set
+int32_t send_buf_try(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num, uint8_t *packet) {
+	return send_packet(buf, len, connection, flag, seq_num, packet);
+}
+
+static int32_t send_packet(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num,
+	uint8_t *packet) {
+	int32_t sentLen = 0;
+
+	if ((sentLen = sendtoErr(connection->sk_num, packet, buildPacket(buf, len, flag, seq_num, packet), 0,
+		(struct sockaddr *) &(connection->remote), connection->len)) >= 0) {
+		traceEvent(TRACE_SEND, seq_num, flag, len, 0);
+	}
+	return sentLen;
+}
+
+//Header and checksum in front of len bytes of payload. Returns the packet's length.
+int32_t buildPacket(uint8_t *buf, uint32_t len, uint8_t flag, uint32_t seq_num, uint8_t *packet) {
 	uint16_t checksum = 0;
 	if (len > 0) {
 		memcpy(&packet[7], buf, len);
 	}
+	packet[len + 7] = 0;
 	
 	seq_num = htonl(seq_num);
 	memcpy(&packet[0], &seq_num, sizeof(uint32_t));
 	memset(&packet[4], 0, 2);
 	packet[6] = flag;
 	
-	checksum = in_cksum((unsigned short *)packet, len + 8);
+	checksum = in_cksum((unsigned short *)packet, len + HEADER_LEN);
 	memcpy(&packet[4], &checksum, 2);
-	
-	if ((sentLen = sendtoErr(connection->sk_num, packet, len+8, 0, 
-		(struct sockaddr *) &(connection->remote), connection->len)) < 0) {
-		perror("send_buf, sendto");
-		exit(-1);
-	}
-	return sentLen;
+	return len + HEADER_LEN;
 }
 
 int32_t recv_buf(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection, uint8_t *flag, int32_t *seq_num) {
-	char data_buf[MAX_LEN];
-	int32_t recv_len = 0;
+	return recv_packet(buf, len, recv_sk_num, connection, flag, seq_num, 0);
+}
+
+//Same as recv_buf, but returns NO_PACKET instead of blocking
+int32_t recv_buf_nowait(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection, uint8_t *flag, int32_t *seq_num) {
+	return recv_packet(buf, len, recv_sk_num, connection, flag, seq_num, MSG_DONTWAIT);
+}
+
+static int32_t recv_packet(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection,
+	uint8_t *flag, int32_t *seq_num, int recvFlags) {
+	char data_buf[len];
+	int32_t recv_len = 0, packetLen = 0;
 	uint32_t remoteLen = sizeof(struct sockaddr_in);
-	if((recv_len = recvfromErr(recv_sk_num, data_buf, len, 0, 
+	if((recv_len = recvfromErr(recv_sk_num, data_buf, len, recvFlags, 
 		(struct sockaddr *) &(connection->remote), &remoteLen)) < 0) {
+		if ((recvFlags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return NO_PACKET;
+		}
 		perror("Recv_buf, recvFrom");
 		exit(-1);
 	}
 	connection->len = remoteLen;
-	if (in_cksum((unsigned short *)data_buf, recv_len) != 0) {
+	packetLen = recv_len;
+	if ((recv_len = parsePacket((uint8_t *) data_buf, recv_len, buf, flag, seq_num)) == CRC_ERROR) {
+		traceEvent(TRACE_CRC_ERROR, 0, 0, packetLen > HEADER_LEN ? packetLen - HEADER_LEN : 0, 0);
+	}
+	else {
+		traceEvent(TRACE_RECV, *seq_num, *flag, recv_len, 0);
+	}
+	return recv_len;
+}
+
+//Check a received packet and take its header apart. Returns the payload's length, or CRC_ERROR.
+//A runt shorter than the header is CRC_ERROR too; its length would come out as CRC_ERROR or NO_PACKET.
+int32_t parsePacket(uint8_t *data_buf, int32_t recv_len, uint8_t *buf, uint8_t *flag, int32_t *seq_num) {
+	if (recv_len < HEADER_LEN || in_cksum((unsigned short *)data_buf, recv_len) != 0) {
 		return CRC_ERROR;
 	}
 	else {
@@ -146,8 +357,8 @@ int32_t recv_buf(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *con
 	   *seq_num = ntohl(*seq_num);
 	   
 		if (recv_len > 7) {
-			memcpy(buf, &data_buf[7], recv_len - 8);
+			memcpy(buf, &data_buf[7], recv_len - HEADER_LEN);
 		}
 	}
-	return (recv_len - 8);
+	return (recv_len - HEADER_LEN);
 }
\ No newline at end of file
@@ -14,10 +14,17 @@
 #include <strings.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
+#include <limits.h>
 
 
 #include "cpe464.h"
+#include "timers.h"
+
+//Bytes of a HOLE_FLAG packet's payload: the hole's length, big endian
+#define HOLE_LEN_SIZE 8
 
 //Starting Sequence Number
 #define START_SEQ_NUM 1
@@ -30,20 +37,66 @@
 #define SHORT_TIME 1
 #define LONG_TIME 10
 
-//Minimum and Maximum Buffer Lengths
+//Priority classes rCopy can ask for when it sends the filename (-p). The Server shares out what it
+//takes in between Sessions by them; old rCopys that don't say get PRIORITY_NORMAL.
+#define PRIORITY_BULK 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_INTERACTIVE 2
+#define MAX_PRIORITY PRIORITY_INTERACTIVE
+
+//Minimum and Maximum Buffer Lengths. AUTO_BUF_LEN has rCopy probe the path for one.
 #define MIN_BUF_LEN 400
-#define MAX_BUF_LEN 1400
+#define MAX_BUF_LEN 65000
+#define AUTO_BUF_LEN 0
+//Fits a 1500 byte MTU with room to spare; used when probing gets no answer
+#define SAFE_BUF_LEN 1400
 
 //Minimum and Maximum Error Rates
 #define MIN_ERR 0
 #define MAX_ERR 1
 
-//size of bufSize; Maximum Length of Buffer
+//size of bufSize; Maximum Length of a control packet (filename, ACKs)
+//Data packets are bufSize + HEADER_LEN, sized at run time
 #define SIZE_OF_BUF_SIZE 4
 #define MAX_LEN 1500
+#define HEADER_LEN 8
+//FN_GOOD payload: the accepted bufSize, whether the Server keeps a Chunk store, then the accepted Window
+#define FN_GOOD_LEN (2 * SIZE_OF_BUF_SIZE + 1)
+//Largest Window (packets) either end will use
+#define MAX_WINDOW (1 << 20)
+
+//Path MTU probing: MTUs tried below the largest payload, IP + UDP header bytes,
+//tries per size, and wait per try (msec)
+#define JUMBO_MTU 9000
+#define ETHERNET_MTU 1500
+#define IP_UDP_HEADER_LEN 28
+#define PROBE_TRIES 3
+#define PROBE_WAIT 200
 
 //CRC Error for Bit Flips
 #define CRC_ERROR -1
+//Nothing waiting on a non-blocking receive
+#define NO_PACKET -2
+
+//Server RRs: default in-order packets per RR, and default/maximum delay (msec)
+//The delay must stay well under MIN_RTO or rCopy resends what already arrived
+#define DEFAULT_ACK_EVERY 4
+#define DEFAULT_ACK_DELAY 20
+#define MAX_ACK_DELAY 100
+//Server with -s: a hole is SREJed again once twice the usual repair lag has passed, plus this many packets or usec
+#define SREJ_SLACK 4
+#define SREJ_SLACK_USEC 250
+//How long the server stays to re-ACK a resent EOF (msec). Matches rCopy's longest backoff.
+#define LINGER_TIME (LONG_TIME * 1000)
+
+//Multicast: receivers per group, hops, and NAK/ACK timing (msec)
+#define MAX_RECEIVERS 63
+#define MC_TTL 8
+#define MC_NAK_BACKOFF 20
+#define MC_NAK_RETRY 100
+#define MC_ACK_DELAY 50
+//Distinct receivers NAKing a packet before its repair is multicast
+#define MC_MULTICAST_REPAIR 2
 
 
 //Define flags
@@ -55,6 +108,13 @@
 #define END_OF_FILE 8
 #define FN_BAD 10
 #define FN_GOOD 11
+#define PROBE_FLAG 12
+#define WIN_PROBE_FLAG 13
+#define EOF_BAD 14
+#define HOLE_FLAG 15
+#define CHUNK_QUERY_FLAG 16
+#define CHUNK_HAVE_FLAG 17
+#define CHUNK_REF_FLAG 18
 
 enum SELECT { SET_NULL, NOT_NULL};
 
@@ -71,7 +131,12 @@ typedef struct {
   uint32_t seqNum;
   int32_t buf_len;
   uint8_t flag;
-  uint8_t buf[MAX_LEN];
+  uint32_t tries;
+  uint64_t sendTime;
+  uint64_t nakMask;
+  uint64_t nakTime;
+  TimerNode timer;
+  uint8_t *buf;
 } Window;
 
 
@@ -79,7 +144,21 @@ typedef struct {
 int32_t udpSetup (int portNum);
 int32_t selectCall (int32_t socketNum, int32_t seconds, int32_t microseconds, int32_t setNull);
 int32_t send_buf(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num, uint8_t *packet);
+int32_t send_buf_try(uint8_t *buf, uint32_t len, Connection *connection, uint8_t flag, uint32_t seq_num, uint8_t *packet);
 int32_t recv_buf(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection, uint8_t *flag, int32_t *seq_num);
+int32_t buildPacket(uint8_t *buf, uint32_t len, uint8_t flag, uint32_t seq_num, uint8_t *packet);
+int32_t parsePacket(uint8_t *data_buf, int32_t recv_len, uint8_t *buf, uint8_t *flag, int32_t *seq_num);
+int32_t recv_buf_nowait(uint8_t *buf, int32_t len, int32_t recv_sk_num, Connection *connection, uint8_t *flag, int32_t *seq_num);
 int processSelect(Connection * client, int *retryCount, int selectTimeoutState, int dataReadyState, int doneState);
 int32_t udp_client_setup (char *hostname, uint16_t portNum, Connection *connection);
+int32_t isMulticast(struct sockaddr_in *addr);
+int32_t mcastSetup(char *group, int portNum, char *iface);
+void mcastSenderSetup(Connection *connection, char *iface);
+int32_t selectPair(int32_t first, int32_t second, int32_t seconds, int32_t microseconds);
+int32_t sameAddr(struct sockaddr_in *first, struct sockaddr_in *second);
+void sizeSocket(int32_t socketNum, int64_t bytes);
+Window *windowAlloc(int32_t windowSize, int32_t bufSize);
+void putHoleLen(uint8_t *buf, uint64_t len);
+uint64_t getHoleLen(uint8_t *buf);
+void windowFree(Window *winBuf);
 #endif
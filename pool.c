@@ -0,0 +1,258 @@
+/*
+ * The Server's pool of payload buffers for packets held past a hole.
+ * One shared mapping, made before any Session is forked, is cut into
+ * Slabs; a Slab is cut into buffers of the size a Session negotiated
+ * when that size first needs one, and goes back to idle once they are
+ * all returned. Nothing is allocated past the budget.
+ */
+#include <sys/mman.h>
+#include <inttypes.h>
+
+#include "networks.h"
+#include "pool.h"
+
+#define PAGE_LEN 4096
+
+static void poolLock(Pool *pool);
+static uint32_t slabsFor(size_t bytes);
+static void bufRelease(Pool *pool, int32_t index, int32_t buffer);
+static void slabUnlink(Pool *pool, int32_t *head, int32_t index);
+static void slabPush(Pool *pool, int32_t *head, int32_t index);
+
+//Map budget bytes of buffers, shared with every child forked after this
+Pool *poolInit(uint64_t budget) {
+	pthread_mutexattr_t attr;
+	Pool *pool = NULL;
+	int32_t slabCount = budget / POOL_SLAB, index = 0;
+	uint64_t header = sizeof(Pool) + slabCount * (sizeof(Slab) + (uint64_t) POOL_SLOTS * sizeof(pid_t)), mapLen = 0;
+
+	header = (header + PAGE_LEN - 1) / PAGE_LEN * PAGE_LEN;
+	//Worked out in 64 bits, as a big budget won't fit in a 32 bit size_t
+	if ((mapLen = header + (uint64_t) slabCount * POOL_SLAB) > SIZE_MAX) {
+		printf("Pool budget too big for this machine. (%" PRIu64 " MB)\n", budget >> 20);
+		exit(-1);
+	}
+
+	//Pages are only backed once a buffer on them is first used
+	pool = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pool == MAP_FAILED) {
+		perror("poolInit, mmap");
+		exit(-1);
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&pool->lock, &attr) != 0) {
+		perror("poolInit, pthread_mutex_init");
+		exit(-1);
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	//The mapping starts zeroed, so no buffer has an owner and every Member is free
+	pool->slabs = (Slab *) (pool + 1);
+	pool->owners = (pid_t *) (pool->slabs + slabCount);
+	pool->base = (uint8_t *) pool + header;
+	pool->slabCount = slabCount;
+	pool->idle = -1;
+	pool->idleCount = 0;
+	pool->reserved = 0;
+	pool->sessions = 0;
+	for (index = 0; index < POOL_CLASSES; index++) {
+		pool->partial[index] = -1;
+		pool->spare[index] = 0;
+	}
+	for (index = slabCount - 1; index >= 0; index--) {
+		slabPush(pool, &pool->idle, index);
+	}
+	pool->idleCount = slabCount;
+	return pool;
+}
+
+//A Session is starting; the free buffers are shared out between one more. What it allocates for itself
+//to keep track of its buffers comes out of the budget too, as whole Slabs no buffer may be cut from.
+//*reserved is set to how many Slabs that set aside. Returns the Member it's kept as, for poolLeave,
+//or -1 if there were none free; such a Session still counts, but can't be cleaned up after if it dies.
+int32_t poolJoin(Pool *pool, size_t reserve, uint32_t *reserved) {
+	int32_t member = 0;
+
+	*reserved = slabsFor(reserve);
+	poolLock(pool);
+	for (member = 0; member < POOL_MEMBERS && pool->members[member].pid != 0; member++) {}
+	if (member < POOL_MEMBERS) {
+		pool->members[member].pid = getpid();
+		pool->members[member].reserved = *reserved;
+	}
+	else {
+		member = -1;
+	}
+	pool->sessions++;
+	pool->reserved += *reserved;
+	pthread_mutex_unlock(&pool->lock);
+	return member;
+}
+
+void poolLeave(Pool *pool, int32_t member, uint32_t reserved) {
+	poolLock(pool);
+	pool->sessions--;
+	pool->reserved -= reserved;
+	if (member >= 0) {
+		pool->members[member].pid = 0;
+		pool->members[member].reserved = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//A child exited. If it died before leaving, give back its buffers and what it set aside.
+void poolReap(Pool *pool, pid_t pid) {
+	int32_t member = 0, index = 0, buffer = 0;
+
+	poolLock(pool);
+	for (member = 0; member < POOL_MEMBERS; member++) {
+		if (pool->members[member].pid == pid) {
+			pool->sessions--;
+			pool->reserved -= pool->members[member].reserved;
+			pool->members[member].pid = 0;
+			pool->members[member].reserved = 0;
+		}
+	}
+	for (index = 0; index < pool->slabCount; index++) {
+		//Buffers past carved were never handed out; the Slab may go idle partway through
+		for (buffer = 0; pool->slabs[index].used > 0 && buffer < (int32_t) pool->slabs[index].carved; buffer++) {
+			if (pool->owners[(size_t) index * POOL_SLOTS + buffer] == pid) {
+				bufRelease(pool, index, buffer);
+			}
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//A buffer of at least size bytes, or NULL if the budget is used up
+uint8_t *poolGet(Pool *pool, int32_t size) {
+	uint32_t class = 0, perSlab = 0;
+	int32_t index = 0, buffer = 0;
+	Slab *slab = NULL;
+
+	size = size > MIN_BUF_LEN ? size : MIN_BUF_LEN;
+	class = (size + POOL_ALIGN - 1) / POOL_ALIGN;
+	perSlab = POOL_SLAB / (class * POOL_ALIGN);
+	poolLock(pool);
+	if ((index = pool->partial[class]) < 0) {
+		//No Slab of this size has room. Cut up an idle one, unless they're all set aside.
+		if ((index = pool->idle) < 0 || pool->idleCount <= pool->reserved) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		slabUnlink(pool, &pool->idle, index);
+		pool->idleCount--;
+		slab = &pool->slabs[index];
+		slab->size = class * POOL_ALIGN;
+		slab->used = 0;
+		slab->carved = 0;
+		slab->free = -1;
+		slabPush(pool, &pool->partial[class], index);
+		pool->spare[class] += perSlab;
+	}
+	slab = &pool->slabs[index];
+	if (slab->free >= 0) {
+		buffer = slab->free;
+		memcpy(&slab->free, pool->base + (size_t) index * POOL_SLAB + buffer * slab->size, sizeof(int32_t));
+	}
+	else {
+		buffer = slab->carved++;
+	}
+	pool->spare[class]--;
+	if (++slab->used == perSlab) {
+		slabUnlink(pool, &pool->partial[class], index);
+	}
+	pool->owners[(size_t) index * POOL_SLOTS + buffer] = getpid();
+	pthread_mutex_unlock(&pool->lock);
+	return pool->base + (size_t) index * POOL_SLAB + buffer * slab->size;
+}
+
+//Give a buffer back. A Slab with nothing left in use goes back to idle, for any size.
+void poolPut(Pool *pool, uint8_t *buf) {
+	int32_t index = (buf - pool->base) / POOL_SLAB;
+
+	poolLock(pool);
+	bufRelease(pool, index, (buf - pool->base - (size_t) index * POOL_SLAB) / pool->slabs[index].size);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//Buffers of size a Session may still count on: its share of those free, split between every Session
+uint32_t poolShare(Pool *pool, int32_t size) {
+	uint32_t class = 0, room = 0;
+
+	size = size > MIN_BUF_LEN ? size : MIN_BUF_LEN;
+	class = (size + POOL_ALIGN - 1) / POOL_ALIGN;
+	poolLock(pool);
+	room = pool->idleCount > pool->reserved ? pool->idleCount - pool->reserved : 0;
+	room = pool->spare[class] + room * (POOL_SLAB / (class * POOL_ALIGN));
+	room /= pool->sessions > 0 ? pool->sessions : 1;
+	pthread_mutex_unlock(&pool->lock);
+	return room;
+}
+
+//Buffers of size the whole budget holds, once reserve bytes of it are set aside. Nothing more can ever be held.
+uint32_t poolCapacity(Pool *pool, int32_t size, size_t reserve) {
+	uint32_t class = 0, slabs = slabsFor(reserve);
+
+	size = size > MIN_BUF_LEN ? size : MIN_BUF_LEN;
+	class = (size + POOL_ALIGN - 1) / POOL_ALIGN;
+	return slabs < (uint32_t) pool->slabCount ? (pool->slabCount - slabs) * (POOL_SLAB / (class * POOL_ALIGN)) : 0;
+}
+
+//A Session killed mid-update leaves the lock to the next one; carry on with it
+static void poolLock(Pool *pool) {
+	if (pthread_mutex_lock(&pool->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&pool->lock);
+	}
+}
+
+static uint32_t slabsFor(size_t bytes) {
+	return (bytes + POOL_SLAB - 1) / POOL_SLAB;
+}
+
+//Put buffer back on its Slab's free list. The lock is held.
+static void bufRelease(Pool *pool, int32_t index, int32_t buffer) {
+	Slab *slab = &pool->slabs[index];
+	uint32_t class = slab->size / POOL_ALIGN, perSlab = POOL_SLAB / slab->size;
+
+	memcpy(pool->base + (size_t) index * POOL_SLAB + buffer * slab->size, &slab->free, sizeof(int32_t));
+	slab->free = buffer;
+	pool->owners[(size_t) index * POOL_SLOTS + buffer] = 0;
+	if (slab->used-- == perSlab) {
+		slabPush(pool, &pool->partial[class], index);
+	}
+	pool->spare[class]++;
+	if (slab->used == 0) {
+		slabUnlink(pool, &pool->partial[class], index);
+		pool->spare[class] -= perSlab;
+		slabPush(pool, &pool->idle, index);
+		pool->idleCount++;
+	}
+}
+
+static void slabUnlink(Pool *pool, int32_t *head, int32_t index) {
+	Slab *slab = &pool->slabs[index];
+
+	if (slab->prev >= 0) {
+		pool->slabs[slab->prev].next = slab->next;
+	}
+	else {
+		*head = slab->next;
+	}
+	if (slab->next >= 0) {
+		pool->slabs[slab->next].prev = slab->prev;
+	}
+}
+
+static void slabPush(Pool *pool, int32_t *head, int32_t index) {
+	Slab *slab = &pool->slabs[index];
+
+	slab->prev = -1;
+	slab->next = *head;
+	if (*head >= 0) {
+		pool->slabs[*head].prev = index;
+	}
+	*head = index;
+}
@@ -0,0 +1,71 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "networks.h"
+
+//Default and Maximum Memory for every Session's held packets together (MB)
+#define DEFAULT_POOL_MB 256
+#define MAX_POOL_MB 65536
+
+//Bytes in a Slab. Each is cut into buffers of one size, rounded up to POOL_ALIGN.
+#define POOL_SLAB (256 * 1024)
+#define POOL_ALIGN 64
+#define POOL_CLASSES (MAX_BUF_LEN / POOL_ALIGN + 2)
+
+//Most buffers a Slab is cut into: buffers are never smaller than MIN_BUF_LEN
+#define POOL_SLOTS (POOL_SLAB / ((MIN_BUF_LEN + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN))
+
+//Sessions the Pool keeps track of at once, so a child that dies can be cleaned up after
+#define POOL_MEMBERS 4096
+
+//Struct Declaration for a Slab.
+//Buffers below carved have been handed out before; free lists the ones given back, by index.
+//prev/next link the Slab into its size's list of partly used Slabs, or into the idle list.
+typedef struct {
+	int32_t prev;
+	int32_t next;
+	uint32_t size;
+	uint32_t used;
+	uint32_t carved;
+	int32_t free;
+} Slab;
+
+//Struct Declaration for a Session using the Pool: the child it runs in, and the Slabs it set aside
+typedef struct {
+	pid_t pid;
+	uint32_t reserved;
+} Member;
+
+//Struct Declaration for the Server's Buffer Pool. It lives in memory shared with every forked
+//Session, so one budget covers them all. partial heads each size's list of Slabs with room,
+//and spare counts the free buffers in them.
+//reserved is how many idle Slabs' worth of the budget Sessions have set aside for their own bookkeeping.
+//owners holds the pid that has each buffer, POOL_SLOTS to a Slab, 0 for none.
+typedef struct {
+	pthread_mutex_t lock;
+	uint8_t *base;
+	Slab *slabs;
+	pid_t *owners;
+	int32_t slabCount;
+	int32_t idle;
+	uint32_t idleCount;
+	uint32_t reserved;
+	uint32_t sessions;
+	int32_t partial[POOL_CLASSES];
+	uint32_t spare[POOL_CLASSES];
+	Member members[POOL_MEMBERS];
+} Pool;
+
+//Headers for Functions in pool.c
+Pool *poolInit(uint64_t budget);
+int32_t poolJoin(Pool *pool, size_t reserve, uint32_t *reserved);
+void poolLeave(Pool *pool, int32_t member, uint32_t reserved);
+void poolReap(Pool *pool, pid_t pid);
+uint8_t *poolGet(Pool *pool, int32_t size);
+void poolPut(Pool *pool, uint8_t *buf);
+uint32_t poolShare(Pool *pool, int32_t size);
+uint32_t poolCapacity(Pool *pool, int32_t size, size_t reserve);
+#endif
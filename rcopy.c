@@ -1,5 +1,13 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
 #include "networks.h"
 #include "cpe464.h"
+#include "ring.h"
+#include "window.h"
+#include "hash.h"
+#include "chunk.h"
+#include "trace.h"
 
 #define MAX_ARGS 8
 #define MAX_FILENAME_LEN 100
@@ -7,38 +15,129 @@
 //Enum Declaration for State Differentiation
 typedef enum State STATE;
 enum State {
-	START, FILENAME, DONE, SEND_RM_FILE, SEND_DATA, WIN_CLOSED, END_DATA
+	START, FILENAME, DONE, SEND_RM_FILE, SEND_DATA, WIN_CLOSED, END_DATA, RESEND
 };
 
+//Struct Declaration for Optional Arguments
+typedef struct {
+	uint32_t ringDepth;
+	int32_t minReceivers;
+	char *iface;
+	char *trace;
+	int32_t priority;
+} Options;
+
+//Struct Declaration for a Multicast Receiver
+typedef struct {
+	struct sockaddr_in addr;
+	uint32_t ack;
+	uint32_t rwnd;
+	uint64_t lastHeard;
+	int32_t active;
+	int32_t done;
+} Receiver;
+
+//Struct Declaration for the Receivers of a Multicast Group
+//corrupt counts receivers whose copy didn't hash the same.
+typedef struct {
+	int32_t enabled;
+	int32_t count;
+	int32_t corrupt;
+	Receiver receivers[MAX_RECEIVERS];
+} Group;
+
+//nakMask bit marking a packet whose repair already went to the whole group
+#define MC_REPAIRED (1ULL << 63)
+
+//Struct Declaration for the Disk Reader Thread.
+//hash covers everything read so far; its Digest rides at the end of the EOF packet.
+//holeAt is where SEEK_HOLE says the next hole starts. spare holds data that has to wait behind a hole.
+//With a Chunk store, pool holds what's read ahead and query asks the Server about Chunks (sk_num -1 without one).
+typedef struct {
+	Ring ring;
+	HashState hash;
+	uint64_t offset;
+	uint64_t holeAt;
+	uint8_t *spare;
+	uint8_t *pool;
+	Connection query;
+	uint32_t querySeq;
+	int32_t batch;
+	int32_t dataFile;
+	int32_t bufSize;
+	int32_t stop;
+	int32_t running;
+	pthread_t thread;
+} Reader;
+
 //Function Headers
-void checkArgs(int argc, char **argv);
-void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection server);
-STATE startState (char **argv, Connection *server);
+void checkArgs(int argc, char **argv, Options *options);
+void processOptions(int argc, char **argv, Options *options);
+void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection server, Options *options);
+STATE startState (char **argv, Connection *server, Options *options);
 STATE fileName(int *outputFileDes, char *filename);
-STATE remoteFileName (char *filename, int32_t bufSize, int32_t windowSize, Connection *server);
-int32_t loadData (Window *winBuf, int32_t dataFile, int32_t windowSize, int32_t bufSize, uint32_t *seqNum);
-STATE sendData(Window *winBuf, int32_t windowSize, Connection *connection, int32_t index, int32_t *bottomEdge, int32_t *upperEdge);
+int32_t probePath(Connection *server);
+int32_t probeAck(Connection *server, int32_t size);
+STATE remoteFileName (char *filename, int32_t *bufSize, int32_t *windowSize, int32_t priority, Connection *server, int32_t *dedup);
+void startReader(Reader *reader, int32_t dataFile, int32_t bufSize, uint32_t ringDepth, Connection *store);
+void stopReader(Reader *reader);
+void *readerThread(void *arg);
+void *chunkReader(void *arg);
+int32_t sendChunks(Reader *reader, uint8_t *buf, uint32_t *cuts, int32_t count, uint64_t *hole);
+void askChunks(Reader *reader, uint8_t *ids, int32_t count, uint8_t *have);
+int32_t queueData(Reader *reader, uint8_t *buf, uint32_t len, uint8_t flag);
+RingSlot *nextSlot(Reader *reader);
+uint64_t skipHole(Reader *reader);
+int32_t allZero(uint8_t *buf, int32_t len);
+STATE sendData(Window *winBuf, int32_t windowSize, Connection *connection, int32_t index, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt);
+void sendPacket(Window *slot, Connection *connection, TimerWheel *wheel, RttState *rtt);
 void updateWindow (int32_t windowSize, int32_t *bottomEdge, int32_t *upperEdge, uint32_t ackNum);
-uint32_t getAck(Connection *connection, uint32_t *ack);
-STATE winClosed (Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, Window *windowBuf, int32_t windowSize, uint32_t *resendCnt);
-STATE lastPacket (Window *windowBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, uint32_t *lastCnt);
+void ackPackets(Window *winBuf, int32_t windowSize, int32_t *bottomEdge, int32_t *upperEdge, uint32_t ackNum,
+	TimerWheel *wheel, RttState *rtt);
+STATE checkTimers(Window *winBuf, Connection *connection, TimerWheel *wheel, RttState *rtt, STATE curState);
+int32_t waitTimers(Connection *connection, TimerWheel *wheel);
+int32_t drainAcks(Window *winBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt);
+int32_t drainDue(Window *slot, int32_t windowSize, int32_t bottomEdge);
+void probeWindow(Connection *connection, int32_t bottomEdge);
+STATE winClosed (Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, Window *windowBuf, int32_t windowSize,
+	TimerWheel *wheel, RttState *rtt);
+STATE lastPacket (Window *windowBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt);
+STATE joinGroup (char *filename, int32_t *bufSize, int32_t *windowSize, Connection *server, Group *group, int32_t minReceivers);
+STATE groupSendData(Window *winBuf, int32_t windowSize, Connection *server, Group *group, int32_t index,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt);
+STATE groupWait(Window *winBuf, int32_t windowSize, Connection *server, Group *group,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt, STATE curState);
+void groupAck(Window *winBuf, int32_t windowSize, Connection *server, Group *group,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt);
+void repairPacket(Window *winBuf, int32_t windowSize, Connection *server, Group *group, int32_t receiver,
+	uint32_t seq, TimerWheel *wheel, RttState *rtt);
+int32_t groupCheck(Window *winBuf, int32_t windowSize, Group *group, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt);
+int32_t findReceiver(Group *group, struct sockaddr_in *addr);
 
 
 int main(int argc, char * argv[]) {
 	Connection server;
 	int32_t outputFileDes = 0;
 	STATE state = START;
+	Options options;
 
-	checkArgs(argc, argv);
+	checkArgs(argc, argv, &options);
+	if (options.trace != NULL) {
+		traceStart(options.trace);
+	}
 	sendErr_init(atof(argv[4]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);
-	cycleState(state, argv, outputFileDes, server);
+	cycleState(state, argv, outputFileDes, server, &options);
 	return 0;
 }
 
 //Process Arguments to check for their Validity
-void checkArgs(int argc, char **argv) {
-	if (argc != MAX_ARGS) {
-		printf("Usage %s fromFile toFile bufferSize errorRate windowSize shostName port\n", argv[0]);
+void checkArgs(int argc, char **argv, Options *options) {
+	if (argc < MAX_ARGS) {
+		printf("Usage %s fromFile toFile bufferSize(0 = probe) errorRate windowSize shostName port [-r ringDepth] [-n receivers] [-i interface] [-t traceFile] [-p priority]\n", argv[0]);
 		exit(-1);
 	}
 	if (strlen(argv[1]) > MAX_FILENAME_LEN) {
@@ -49,31 +148,100 @@ void checkArgs(int argc, char **argv) {
 		printf("TO file name too long must be within 100 and is: %d\n", strlen(argv[2]));
 		exit(-1);
 	}
-	if (atoi(argv[3]) < MIN_BUF_LEN || atoi(argv[3]) > MAX_BUF_LEN) {
-		printf("Invalid buffer. (Must be between 400 and 1400) Input Buffer: %d\n", atoi(argv[3]));
-
+	if (atoi(argv[3]) != AUTO_BUF_LEN && (atoi(argv[3]) < MIN_BUF_LEN || atoi(argv[3]) > MAX_BUF_LEN)) {
+		printf("Invalid buffer. (Must be 0 or between %d and %d) Input Buffer: %d\n", MIN_BUF_LEN, MAX_BUF_LEN, atoi(argv[3]));
+		exit(-1);
+	}
+	if (atoi(argv[5]) < 1 || atoi(argv[5]) > MAX_WINDOW) {
+		printf("Invalid window. (Must be between 1 and %d) Input Window: %d\n", MAX_WINDOW, atoi(argv[5]));
+		exit(-1);
 	}
 	if (atof(argv[4]) < MIN_ERR || atof(argv[4]) >= MAX_ERR){
 		printf("Invalid error Rate. (Must be between 0 and 1) Input Error: %f\n", atof(argv[4]));
 		exit(-1);
 	}
+	processOptions(argc, argv, options);
+}
+
+//Process the Optional Arguments following the port
+void processOptions(int argc, char **argv, Options *options) {
+	int index = MAX_ARGS;
+
+	options->ringDepth = DEFAULT_RING_DEPTH;
+	options->minReceivers = 0;
+	options->iface = NULL;
+	options->trace = NULL;
+	options->priority = PRIORITY_NORMAL;
+
+	while (index < argc) {
+		if (strcmp(argv[index], "-r") == 0 && index + 1 < argc) {
+			options->ringDepth = atoi(argv[++index]);
+			if (options->ringDepth < 1 || options->ringDepth > MAX_RING_DEPTH) {
+				printf("Invalid ring depth. (Must be between 1 and %d) Input Depth: %s\n", MAX_RING_DEPTH, argv[index]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-n") == 0 && index + 1 < argc) {
+			//Multicast: receivers that must join before sending
+			options->minReceivers = atoi(argv[++index]);
+			if (options->minReceivers < 0 || options->minReceivers > MAX_RECEIVERS) {
+				printf("Invalid receiver count. (Must be between 0 and %d) Input Count: %s\n", MAX_RECEIVERS, argv[index]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-i") == 0 && index + 1 < argc) {
+			//Multicast: interface to send the group traffic out of
+			options->iface = argv[++index];
+		}
+		else if (strcmp(argv[index], "-t") == 0 && index + 1 < argc) {
+			//Binary packet trace for tracedump
+			options->trace = argv[++index];
+		}
+		else if (strcmp(argv[index], "-p") == 0 && index + 1 < argc) {
+			//Priority class the Server schedules us in: 0 bulk, 1 normal, 2 interactive
+			options->priority = atoi(argv[++index]);
+			if (options->priority < PRIORITY_BULK || options->priority > MAX_PRIORITY) {
+				printf("Invalid priority. (Must be between %d and %d) Input Priority: %s\n", PRIORITY_BULK, MAX_PRIORITY, argv[index]);
+				exit(-1);
+			}
+		}
+		else {
+			printf("Unknown option: %s\n", argv[index]);
+			exit(-1);
+		}
+		index++;
+	}
 }
 
 //Cycle through various States
-void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection server) {
-	STATE curState = state;
+void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection server, Options *options) {
+	STATE curState = state, lastState = state;
 	int32_t fromFile = 0;
 	int32_t bufSize = atoi(argv[3]);
 	int32_t windowSize = atoi(argv[5]), bottomEdge = 1;
+	int32_t dedup = 0, useStore = 1;
    int32_t upperEdge = bottomEdge + windowSize;
    int index = 0;
-   Window *winBuf = malloc(sizeof(Window) * windowSize);
-   uint32_t seqNum = 1, resendCnt = 0, lastCnt = 0;
+   Window *winBuf = NULL;
+   uint32_t seqNum = 1;
+	TimerWheel wheel;
+	RttState rtt;
+	Reader reader;
+	Group group;
+
+	wheelInit(&wheel, timeNowMs());
+	rttInit(&rtt);
+	reader.running = 0;
+	group.enabled = 0;
+	group.count = 0;
+	group.corrupt = 0;
 	while (curState != DONE) {
 		switch (curState) {
 			case START:	
 				//Initial State
-				curState = startState(argv, &server);
+				curState = startState(argv, &server, options);
+				//A multicast shostName sends to every receiver in the group
+				group.enabled = (curState != DONE && isMulticast(&server.remote));
 				break;
 			case FILENAME: 
 				//Locate and open local file for reading
@@ -81,14 +249,41 @@ void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection ser
 				break;
 			case SEND_RM_FILE:	
 				//Locate/Create remote file for writing
-				curState = remoteFileName(argv[2], atoi(argv[3]), windowSize, &server);
+				if (bufSize == AUTO_BUF_LEN) {
+					//Receivers of a group may sit behind different links; stay safe there
+					bufSize = group.enabled ? SAFE_BUF_LEN : probePath(&server);
+				}
+				if (group.enabled) {
+					curState = joinGroup(argv[2], &bufSize, &windowSize, &server, &group, options->minReceivers);
+				}
+				else {
+					curState = remoteFileName(argv[2], &bufSize, &windowSize, options->priority, &server, &dedup);
+					dedup = dedup && useStore;
+				}
+				if (curState == SEND_DATA) {
+					//Server is ready with the payload size and Window it accepted.
+					//Every window slot carries its own retransmission timer.
+					upperEdge = bottomEdge + windowSize;
+					winBuf = windowAlloc(windowSize, bufSize);
+					for (index = 0; index < windowSize; index++) {
+						timerInit(&winBuf[index].timer, index);
+					}
+					sizeSocket(server.sk_num, (int64_t) windowSize * (bufSize + HEADER_LEN));
+					//Start reading ahead of the Window. With a Chunk store it asks about Chunks as it goes.
+					startReader(&reader, fromFile, bufSize, options->ringDepth, dedup ? &server : NULL);
+				}
 				break;
 			case SEND_DATA:	
 				//Send Data
 				if (seqNum < upperEdge) {
-					//Window Open
-					index = loadData(winBuf, fromFile, windowSize, bufSize, &seqNum);
-					curState = sendData(winBuf, windowSize, &server, index, &bottomEdge, &upperEdge);
+					//Window Open. index is -1 if the disk hasn't caught up.
+					index = loadData(winBuf, &reader.ring, windowSize, &seqNum);
+					if (group.enabled) {
+						curState = groupSendData(winBuf, windowSize, &server, &group, index, &bottomEdge, &upperEdge, &wheel, &rtt);
+					}
+					else {
+						curState = sendData(winBuf, windowSize, &server, index, &bottomEdge, &upperEdge, &wheel, &rtt);
+					}
 				}
 				else {
 					//Window Closed
@@ -97,22 +292,41 @@ void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection ser
 				}
 				break;
 			case WIN_CLOSED:	
-				//Window Closed, Resend packet
-				curState = winClosed(&server, &bottomEdge, &upperEdge, winBuf, windowSize, &resendCnt);
-				if (resendCnt == MAX_TRIES) {
-					//Packet lost 10 times.
-					printf("Sent 10 times. Terminating.\n");
-					curState = DONE;
+				//Window Closed, wait for ACKs or a retransmission timer
+				if (group.enabled) {
+					curState = groupWait(winBuf, windowSize, &server, &group, &bottomEdge, &upperEdge, &wheel, &rtt, WIN_CLOSED);
+				}
+				else {
+					curState = winClosed(&server, &bottomEdge, &upperEdge, winBuf, windowSize, &wheel, &rtt);
 				}
 				break;
 			case END_DATA:	
 				//Last Packet in File
-				curState = lastPacket(winBuf, windowSize, &server, &bottomEdge, &upperEdge, &lastCnt);
-				if (lastCnt == MAX_TRIES) {
-					//Packet was lost 10 times.
-					printf("Sent last packet 10 times, Terminating.\n");
-					curState = DONE;
+				if (group.enabled) {
+					curState = groupWait(winBuf, windowSize, &server, &group, &bottomEdge, &upperEdge, &wheel, &rtt, END_DATA);
 				}
+				else {
+					curState = lastPacket(winBuf, windowSize, &server, &bottomEdge, &upperEdge, &wheel, &rtt);
+				}
+				break;
+			case RESEND:
+				//The Server's copy is bad. If it was built from its Chunk store, a Chunk there may have gone bad;
+				//the Server has dropped it, so send the whole file again without the store.
+				if (!dedup) {
+					exit(-1);
+				}
+				printf("Sending the file again without the Chunk store.\n");
+				stopReader(&reader);
+				windowFree(winBuf);
+				winBuf = NULL;
+				close(fromFile);
+				wheelInit(&wheel, timeNowMs());
+				seqNum = 1;
+				bottomEdge = 1;
+				upperEdge = bottomEdge + windowSize;
+				dedup = 0;
+				useStore = 0;
+				curState = START;
 				break;
 			case DONE:	
 				//Done. Terminate
@@ -122,10 +336,19 @@ void cycleState(STATE state, char *argv[], int32_t outputFileDes, Connection ser
 				printf("Error - in default state\n");
 				break;
 		}
+		if (curState != lastState) {
+			traceEvent(TRACE_STATE, curState, 0, 0, lastState);
+			lastState = curState;
+		}
+	}
+	stopReader(&reader);
+	windowFree(winBuf);
+	if (group.corrupt > 0) {
+		exit(-1);
 	}
 }
 
-STATE startState (char **argv, Connection *server) {
+STATE startState (char **argv, Connection *server, Options *options) {
 	STATE returnValue = FILENAME;
 	//If server connection was made previously, close the connection first
 	if (server->sk_num > 0) {
@@ -136,6 +359,10 @@ STATE startState (char **argv, Connection *server) {
 		
 		returnValue = DONE;
 	}
+	else if (isMulticast(&server->remote)) {
+		mcastSenderSetup(server, options->iface);
+		returnValue = FILENAME;
+	}
 	else {
 		returnValue = FILENAME;
 	}
@@ -157,8 +384,78 @@ STATE fileName(int *fromFile, char *filename) {
 	return returnValue;
 }
 
-//Send Requested Remote File to Server
-STATE remoteFileName (char *filename, int32_t bufSize, int32_t windowSize, Connection *server) {
+//Find the largest payload that reaches the Server in one piece. With Don't Fragment set,
+//anything over the local MTU fails to send right away; past that, only an echoed probe counts.
+int32_t probePath(Connection *server) {
+	int32_t sizes[] = {MAX_BUF_LEN, JUMBO_MTU - IP_UDP_HEADER_LEN - HEADER_LEN, ETHERNET_MTU - IP_UDP_HEADER_LEN - HEADER_LEN};
+	int32_t pmtu = IP_PMTUDISC_DO, oldPmtu = IP_PMTUDISC_WANT;
+	socklen_t optLen = sizeof(oldPmtu);
+	int32_t index = 0, tries = 0, found = 0;
+	uint8_t *probe = calloc(1, MAX_BUF_LEN);
+	uint8_t *packet = malloc(MAX_BUF_LEN + HEADER_LEN);
+
+	if (probe == NULL || packet == NULL) {
+		perror("probePath, malloc");
+		exit(-1);
+	}
+	getsockopt(server->sk_num, IPPROTO_IP, IP_MTU_DISCOVER, &oldPmtu, &optLen);
+	setsockopt(server->sk_num, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+	for (index = 0; found == 0 && index < sizeof(sizes) / sizeof(sizes[0]); index++) {
+		for (tries = 0; tries < PROBE_TRIES; tries++) {
+			if (send_buf_try(probe, sizes[index], server, PROBE_FLAG, 0, packet) < 0) {
+				if (errno == EMSGSIZE) {
+					//Too big for the local link; don't bother waiting
+					break;
+				}
+				perror("probePath, sendto");
+				exit(-1);
+			}
+			if (probeAck(server, sizes[index])) {
+				found = sizes[index];
+				break;
+			}
+		}
+	}
+
+	//Data may be fragmented again if the path shrinks later
+	setsockopt(server->sk_num, IPPROTO_IP, IP_MTU_DISCOVER, &oldPmtu, sizeof(oldPmtu));
+	free(probe);
+	free(packet);
+
+	if (found == 0) {
+		//Server didn't answer any probe (or predates them)
+		found = SAFE_BUF_LEN;
+	}
+	printf("Path probe: using %d byte buffers.\n", found);
+	return found;
+}
+
+//Wait for the Server to echo a probe of this size
+int32_t probeAck(Connection *server, int32_t size) {
+	uint8_t packet[MAX_LEN];
+	uint8_t flag = 0;
+	int32_t seqNum = 0;
+	uint32_t echoed = 0;
+	uint64_t deadline = timeNowMs() + PROBE_WAIT;
+	int64_t wait = 0;
+	Connection from;
+
+	while ((wait = deadline - timeNowMs()) > 0 && selectCall(server->sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL)) {
+		if (recv_buf(packet, MAX_LEN, server->sk_num, &from, &flag, &seqNum) == CRC_ERROR || flag != PROBE_FLAG) {
+			continue;
+		}
+		memcpy(&echoed, packet, sizeof(uint32_t));
+		if (ntohl(echoed) == size) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Send Requested Remote File to Server, and the priority class to schedule it in after the name.
+//bufSize and windowSize come back as what the Server accepted, dedup as whether it keeps a Chunk store.
+STATE remoteFileName (char *filename, int32_t *bufSize, int32_t *windowSize, int32_t priority, Connection *server, int32_t *dedup) {
 	STATE returnValue = SEND_RM_FILE;
 	uint8_t packet[MAX_LEN];
 	uint8_t buf[MAX_LEN];
@@ -166,14 +463,14 @@ STATE remoteFileName (char *filename, int32_t bufSize, int32_t windowSize, Conne
 	int32_t seqNum = 0;
 	int32_t nameLength = strlen(filename) + 1;
 	int32_t recv_check = 0;
+	uint32_t accepted = htonl(*bufSize), window = htonl(*windowSize);
 	static int retryCnt = 0;
 
-	bufSize = htonl(bufSize);
-
-	memcpy(buf, &bufSize, SIZE_OF_BUF_SIZE);
-	memcpy(&buf[4], &windowSize, 4);
+	memcpy(buf, &accepted, SIZE_OF_BUF_SIZE);
+	memcpy(&buf[4], &window, 4);
 	memcpy(&buf[8], filename, nameLength);
-	send_buf(buf, nameLength+8, server, REMOTE_FN_FLAG, 0, packet);
+	buf[8 + nameLength] = priority;
+	send_buf(buf, nameLength+9, server, REMOTE_FN_FLAG, 0, packet);
 
 	if ((returnValue = processSelect(server, &retryCnt, SEND_RM_FILE, FN_GOOD, DONE)) == FN_GOOD) {
 		recv_check = recv_buf(packet, MAX_LEN, server->sk_num, server, &flag, &seqNum);
@@ -186,78 +483,509 @@ STATE remoteFileName (char *filename, int32_t bufSize, int32_t windowSize, Conne
 			printf("Error during file open of %s on server.\n", filename);
 			returnValue = DONE;
 		}
-		else {
+		else if (flag == FN_GOOD) {
+			//server->remote is now the Server's session socket; only it is listened to from here on
+			if (recv_check >= SIZE_OF_BUF_SIZE) {
+				memcpy(&accepted, packet, SIZE_OF_BUF_SIZE);
+				if ((int32_t) ntohl(accepted) < *bufSize) {
+					*bufSize = ntohl(accepted);
+				}
+			}
+			*dedup = (recv_check > SIZE_OF_BUF_SIZE && packet[SIZE_OF_BUF_SIZE]);
+			if (recv_check >= FN_GOOD_LEN) {
+				memcpy(&window, packet + SIZE_OF_BUF_SIZE + 1, SIZE_OF_BUF_SIZE);
+				if ((int32_t) ntohl(window) > 0 && (int32_t) ntohl(window) < *windowSize) {
+					*windowSize = ntohl(window);
+				}
+			}
 			returnValue = SEND_DATA;
 		}
+		else {
+			//Late probe echo or the like; ask again
+			returnValue = SEND_RM_FILE;
+		}
 	}
 	return (returnValue);
 }
 
-//Load Data from Local File into Window
-int32_t loadData (Window *winBuf, int32_t dataFile, int32_t windowSize, int32_t bufSize, uint32_t *seqNum) {
-	int32_t readLen = 0;
-	int index = *seqNum % windowSize;
-	if ((readLen = read(dataFile, winBuf[index].buf, bufSize)) <  0) {
-		perror("read Error");
+//Start the Disk Thread filling the Ring. store is the Server's session if it keeps a Chunk store.
+void startReader(Reader *reader, int32_t dataFile, int32_t bufSize, uint32_t ringDepth, Connection *store) {
+	reader->dataFile = dataFile;
+	reader->bufSize = bufSize;
+	reader->stop = 0;
+	reader->offset = 0;
+	reader->holeAt = 0;
+	reader->pool = NULL;
+	reader->query.sk_num = -1;
+	reader->querySeq = 0;
+	//A query has to fit in one of the Server's receive buffers
+	reader->batch = (bufSize - sizeof(uint32_t)) / CHUNK_ID_LEN;
+	reader->batch = reader->batch < CHUNK_BATCH ? reader->batch : CHUNK_BATCH;
+	hashInit(&reader->hash);
+
+	if ((reader->spare = malloc(bufSize)) == NULL) {
+		perror("startReader, malloc");
+		exit(-1);
+	}
+	if (ringInit(&reader->ring, ringDepth, bufSize) < 0) {
+		perror("startReader, ringInit");
 		exit(-1);
 	}
-	else if (readLen != bufSize) {
+	if (store != NULL) {
+		//Queries go on a socket of their own, so their answers don't mix with the ACKs
+		if ((reader->pool = malloc(CHUNK_POOL)) == NULL) {
+			perror("startReader, malloc");
+			exit(-1);
+		}
+		if ((reader->query.sk_num = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			perror("startReader, socket");
+			exit(-1);
+		}
+		reader->query.remote = store->remote;
+		reader->query.len = sizeof(struct sockaddr_in);
+	}
+	if (pthread_create(&reader->thread, NULL, store != NULL ? chunkReader : readerThread, reader) != 0) {
+		perror("startReader, pthread_create");
+		exit(-1);
+	}
+	reader->running = 1;
+}
+
+void stopReader(Reader *reader) {
+	if (reader->running) {
+		__atomic_store_n(&reader->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(reader->thread, NULL);
+		ringFree(&reader->ring);
+		free(reader->spare);
+		free(reader->pool);
+		if (reader->query.sk_num >= 0) {
+			close(reader->query.sk_num);
+		}
+		reader->running = 0;
+	}
+}
+
+//Disk Thread. Reads the file a buffer at a time into the Ring until EOF.
+//Holes, and whole buffers of zeros, go as one HOLE_FLAG packet holding their length.
+void *readerThread(void *arg) {
+	Reader *reader = arg;
+	RingSlot *slot = NULL;
+	int32_t readLen = 0;
+	uint64_t hole = 0;
+
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+		if ((slot = ringProduce(&reader->ring)) == NULL) {
+			//Network is behind. Wait for a free buffer.
+			ringWait();
+			continue;
+		}
+		hole += skipHole(reader);
+		if ((readLen = read(reader->dataFile, slot->buf, reader->bufSize)) < 0) {
+			perror("read Error");
+			exit(-1);
+		}
+		reader->offset += readLen;
+		hashUpdate(&reader->hash, slot->buf, readLen);
+		if (readLen == reader->bufSize && allZero(slot->buf, readLen)) {
+			//Nothing but zeros. Grow the hole and read into the same buffer again.
+			hole += readLen;
+			continue;
+		}
+		if (hole > 0) {
+			//Data again. The hole goes first, so this buffer carries it and the data moves to the next one.
+			memcpy(reader->spare, slot->buf, readLen);
+			putHoleLen(slot->buf, hole);
+			slot->buf_len = HOLE_LEN_SIZE;
+			slot->flag = HOLE_FLAG;
+			ringPublish(&reader->ring);
+			hole = 0;
+			if ((slot = nextSlot(reader)) == NULL) {
+				break;
+			}
+			memcpy(slot->buf, reader->spare, readLen);
+		}
+		slot->buf_len = readLen;
 		//Data doesn't fill up buffer ==> EOF
-		winBuf[index].seqNum = *seqNum;
-		winBuf[index].buf_len = readLen;
-		winBuf[index].flag = END_OF_FILE;
+		slot->flag = (readLen != reader->bufSize) ? END_OF_FILE : DATA_FLAG;
+		if (slot->flag == END_OF_FILE && readLen + HASH_LEN > reader->bufSize) {
+			//No room left for the Digest. Send the tail as data and the Digest on its own.
+			slot->flag = DATA_FLAG;
+			ringPublish(&reader->ring);
+			if ((slot = nextSlot(reader)) == NULL) {
+				break;
+			}
+			slot->buf_len = 0;
+			slot->flag = END_OF_FILE;
+		}
+		if (slot->flag == END_OF_FILE) {
+			hashDigest(&reader->hash, slot->buf + slot->buf_len);
+			slot->buf_len += HASH_LEN;
+		}
+		ringPublish(&reader->ring);
+		if (slot->flag == END_OF_FILE) {
+			break;
+		}
 	}
-	else {
-		//Data fills up buffer
-		winBuf[index].seqNum = *seqNum;
-		winBuf[index].buf_len = readLen;
-		winBuf[index].flag = DATA_FLAG;
-		(*seqNum)++;
+	return NULL;
+}
+
+//Dedup Disk Thread. Reads a pool at a time and cuts it into Chunks the way the Server does.
+//Chunks the Server has stored go as one CHUNK_REF each; the rest go as data. Reads stop at a hole,
+//so a Chunk never spans one and both ends start cutting afresh after it.
+void *chunkReader(void *arg) {
+	Reader *reader = arg;
+	RingSlot *slot = NULL;
+	uint32_t cuts[CHUNK_BATCH];
+	uint32_t filled = 0, pos = 0, start = 0, want = 0;
+	int32_t readLen = 0, count = 0, boundary = 0, eof = 0;
+	uint64_t hole = 0;
+	uint8_t holeLen[HOLE_LEN_SIZE];
+
+	while (!eof) {
+		if (pos > 0) {
+			//Keep the uncut tail at the front
+			memmove(reader->pool, reader->pool + pos, filled - pos);
+			filled -= pos;
+			pos = 0;
+		}
+		if (filled == 0) {
+			hole += skipHole(reader);
+		}
+		want = CHUNK_POOL - filled;
+		if (reader->holeAt - reader->offset < want) {
+			want = reader->holeAt - reader->offset;
+		}
+		if ((readLen = (want > 0) ? read(reader->dataFile, reader->pool + filled, want) : 0) < 0) {
+			perror("read Error");
+			exit(-1);
+		}
+		hashUpdate(&reader->hash, reader->pool + filled, readLen);
+		reader->offset += readLen;
+		filled += readLen;
+		//At a hole or the end, what's left is cut without waiting for more
+		boundary = (readLen == 0);
+		eof = (want > 0 && readLen == 0);
+
+		while (pos < filled && (boundary || filled - pos >= CHUNK_MAX)) {
+			for (start = pos, count = 0; count < reader->batch && pos < filled && (boundary || filled - pos >= CHUNK_MAX); count++) {
+				cuts[count] = chunkCut(reader->pool + pos, filled - pos);
+				pos += cuts[count];
+			}
+			if (sendChunks(reader, reader->pool + start, cuts, count, &hole) < 0) {
+				return NULL;
+			}
+		}
+	}
+	if (hole > 0) {
+		putHoleLen(holeLen, hole);
+		if (queueData(reader, holeLen, HOLE_LEN_SIZE, HOLE_FLAG) < 0) {
+			return NULL;
+		}
+	}
+	//Everything went out already; the EOF carries just the Digest
+	if ((slot = nextSlot(reader)) != NULL) {
+		hashDigest(&reader->hash, slot->buf);
+		slot->buf_len = HASH_LEN;
+		slot->flag = END_OF_FILE;
+		ringPublish(&reader->ring);
 	}
-	return index;
+	return NULL;
 }
 
-//Sends Packet, then checks if any thing from Server
-STATE sendData(Window *winBuf, int32_t windowSize, Connection *connection, int32_t index, int32_t *bottomEdge, int32_t *upperEdge) {
-	uint8_t packet[MAX_LEN] = {0}, ackFlag = 0;
-	uint32_t ack, resendPacket;
+//Ask about a batch of Chunks, then queue them in order. Chunks of zeros join the hole.
+//Data between stored Chunks goes out in full buffers. Returns -1 if told to stop.
+int32_t sendChunks(Reader *reader, uint8_t *buf, uint32_t *cuts, int32_t count, uint64_t *hole) {
+	uint8_t ids[CHUNK_BATCH * CHUNK_ID_LEN];
+	uint8_t have[CHUNK_BITMAP_LEN], zero[CHUNK_BATCH], stored = 0;
+	uint8_t holeLen[HOLE_LEN_SIZE], ref[CHUNK_REF_LEN];
+	int32_t asked[CHUNK_BATCH];
+	int32_t index = 0, queries = 0;
+	uint32_t offset = 0, runStart = 0, len = 0;
 
-	send_buf(winBuf[index].buf, winBuf[index].buf_len, connection, winBuf[index].flag, winBuf[index].seqNum, packet);
+	//Runts aren't stored by the Server, so aren't worth asking about
+	for (index = 0, offset = 0; index < count; offset += cuts[index++]) {
+		asked[index] = -1;
+		zero[index] = allZero(buf + offset, cuts[index]);
+		if (!zero[index] && cuts[index] >= CHUNK_MIN) {
+			chunkId(buf + offset, cuts[index], ids + queries * CHUNK_ID_LEN);
+			asked[index] = queries++;
+		}
+	}
+	askChunks(reader, ids, queries, have);
 
-	if (winBuf[index].flag == END_OF_FILE) {
-		//Sent Last Packet, go to END_DATA State
-		return END_DATA;
+	for (index = 0, offset = 0; index < count; offset += cuts[index++]) {
+		stored = asked[index] >= 0 && (have[asked[index] / 8] & (1 << (asked[index] % 8)));
+		if (!zero[index] && !stored && *hole == 0) {
+			//Plain data joins the run before it
+			continue;
+		}
+		if (queueData(reader, buf + runStart, offset - runStart, DATA_FLAG) < 0) {
+			return -1;
+		}
+		runStart = offset + cuts[index];
+		if (zero[index]) {
+			*hole += cuts[index];
+			continue;
+		}
+		if (*hole > 0) {
+			//Something other than zeros again. The hole goes first.
+			putHoleLen(holeLen, *hole);
+			*hole = 0;
+			if (queueData(reader, holeLen, HOLE_LEN_SIZE, HOLE_FLAG) < 0) {
+				return -1;
+			}
+		}
+		if (!stored) {
+			//Plain data after the hole starts the next run
+			runStart = offset;
+			continue;
+		}
+		memcpy(ref, ids + asked[index] * CHUNK_ID_LEN, CHUNK_ID_LEN);
+		len = htonl(cuts[index]);
+		memcpy(ref + CHUNK_ID_LEN, &len, sizeof(uint32_t));
+		if (queueData(reader, ref, CHUNK_REF_LEN, CHUNK_REF_FLAG) < 0) {
+			return -1;
+		}
 	}
+	return queueData(reader, buf + runStart, offset - runStart, DATA_FLAG);
+}
 
-	//Non blocking Select
-	if (selectCall(connection->sk_num, INSTANT_TIME,0,1)) {
-		ackFlag = getAck(connection, &ack);
-		
-		if (ackFlag == RR_FLAG) {
-			//RR. Move the window properly.
-			updateWindow(windowSize, bottomEdge, upperEdge, ack);
+//Ask the Server which of these Chunks it has stored. No answer after a few tries means none of them.
+void askChunks(Reader *reader, uint8_t *ids, int32_t count, uint8_t *have) {
+	uint8_t query[sizeof(uint32_t) + CHUNK_BATCH * CHUNK_ID_LEN];
+	uint8_t packet[sizeof(query) + HEADER_LEN];
+	uint8_t reply[MAX_LEN];
+	uint8_t flag = 0;
+	int32_t seqNum = 0, tries = 0;
+	uint32_t batch = htonl(count);
+	uint64_t deadline = 0;
+	int64_t wait = 0;
+	Connection from;
+
+	memset(have, 0, CHUNK_BITMAP_LEN);
+	if (count == 0) {
+		return;
+	}
+	memcpy(query, &batch, sizeof(uint32_t));
+	memcpy(query + sizeof(uint32_t), ids, count * CHUNK_ID_LEN);
+	reader->querySeq++;
+	for (tries = 0; tries < CHUNK_TRIES; tries++) {
+		send_buf(query, sizeof(uint32_t) + count * CHUNK_ID_LEN, &reader->query, CHUNK_QUERY_FLAG, reader->querySeq, packet);
+		deadline = timeNowMs() + CHUNK_WAIT;
+		while ((wait = deadline - timeNowMs()) > 0 &&
+			selectCall(reader->query.sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL)) {
+			//An answer to an earlier try of an earlier query is stale
+			if (recv_buf(reply, MAX_LEN, reader->query.sk_num, &from, &flag, &seqNum) == CHUNK_BITMAP_LEN &&
+				flag == CHUNK_HAVE_FLAG && seqNum == reader->querySeq) {
+				memcpy(have, reply, CHUNK_BITMAP_LEN);
+				return;
+			}
 		}
-		else if (ackFlag == SREJ_FLAG) {
-			//SREJ. Resend the requested packet.
-			resendPacket = ack % windowSize;
-			send_buf(winBuf[resendPacket].buf, winBuf[resendPacket].buf_len, connection,
-				winBuf[resendPacket].flag, winBuf[resendPacket].seqNum, packet);
+	}
+}
+
+//Queue len bytes as packets of the given flag, a buffer at a time. Returns -1 if told to stop.
+int32_t queueData(Reader *reader, uint8_t *buf, uint32_t len, uint8_t flag) {
+	RingSlot *slot = NULL;
+	uint32_t piece = 0;
+
+	for (; len > 0; buf += piece, len -= piece) {
+		if ((slot = nextSlot(reader)) == NULL) {
+			return -1;
 		}
+		piece = len < reader->bufSize ? len : reader->bufSize;
+		memcpy(slot->buf, buf, piece);
+		slot->buf_len = piece;
+		slot->flag = flag;
+		ringPublish(&reader->ring);
 	}
-	return SEND_DATA;
+	return 0;
+}
+
+//Wait for another free buffer. NULL if told to stop first.
+RingSlot *nextSlot(Reader *reader) {
+	RingSlot *slot = NULL;
 
+	while ((slot = ringProduce(&reader->ring)) == NULL) {
+		if (__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		ringWait();
+	}
+	return slot;
+}
+
+//If the file has a hole where we are, step over it without reading. Returns its length.
+//Only asks the file system once per run of data, at the hole SEEK_HOLE found last time.
+uint64_t skipHole(Reader *reader) {
+#ifdef SEEK_DATA
+	off_t data = 0, hole = 0;
+	uint64_t len = 0;
+
+	if (reader->offset < reader->holeAt) {
+		return 0;
+	}
+	if ((data = lseek(reader->dataFile, reader->offset, SEEK_DATA)) < 0) {
+		if (errno != ENXIO) {
+			//No SEEK_DATA on this file system. The zero scan still finds holes.
+			reader->holeAt = UINT64_MAX;
+			return 0;
+		}
+		//Hole all the way to the end
+		data = lseek(reader->dataFile, 0, SEEK_END);
+	}
+	hole = lseek(reader->dataFile, data, SEEK_HOLE);
+	reader->holeAt = (hole < 0) ? UINT64_MAX : (uint64_t) hole;
+	if (lseek(reader->dataFile, data, SEEK_SET) < 0) {
+		perror("skipHole, lseek");
+		exit(-1);
+	}
+	len = data - reader->offset;
+	reader->offset = data;
+	hashZeros(&reader->hash, len);
+	return len;
+#else
+	//No SEEK_DATA at all. Reads are never cut short for a hole; the zero scan still finds them.
+	reader->holeAt = UINT64_MAX;
+	return 0;
+#endif
 }
 
-//Retrieve the ACK packet from the Server
-uint32_t getAck(Connection *connection, uint32_t *ack) {
+//16 byte lanes; GCC and Clang put these in the host's SIMD registers
+typedef uint64_t ZeroLanes __attribute__((vector_size(16)));
+
+//Is the buffer nothing but zeros? ORs four vectors at a time and stops at the first set bit.
+int32_t allZero(uint8_t *buf, int32_t len) {
+	ZeroLanes acc, lanes[4];
+	int32_t index = 0;
+
+	for (; index + (int32_t) sizeof(lanes) <= len; index += sizeof(lanes)) {
+		memcpy(lanes, buf + index, sizeof(lanes));
+		acc = lanes[0] | lanes[1] | lanes[2] | lanes[3];
+		if (acc[0] | acc[1]) {
+			return 0;
+		}
+	}
+	for (; index < len; index++) {
+		if (buf[index]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//Sends Packet, then takes in any ACKs once enough have had time to pile up
+STATE sendData(Window *winBuf, int32_t windowSize, Connection *connection, int32_t index, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt) {
+	if (index >= 0) {
+		sendPacket(&winBuf[index], connection, wheel, rtt);
+
+		if (winBuf[index].flag == END_OF_FILE) {
+			//Sent Last Packet, go to END_DATA State
+			return END_DATA;
+		}
+		if (!drainDue(&winBuf[index], windowSize, *bottomEdge)) {
+			return checkTimers(winBuf, connection, wheel, rtt, SEND_DATA);
+		}
+	}
+	else if (!selectCall(connection->sk_num, INSTANT_TIME, RING_WAIT_USEC, NOT_NULL)) {
+		//Disk Thread is behind and the Server has nothing to say
+		return checkTimers(winBuf, connection, wheel, rtt, SEND_DATA);
+	}
+
+	if (drainAcks(winBuf, windowSize, connection, bottomEdge, upperEdge, wheel, rtt) == EOF_BAD) {
+		return RESEND;
+	}
+	return checkTimers(winBuf, connection, wheel, rtt, SEND_DATA);
+
+}
+
+//Only look for ACKs every quarter Window, or once the Window is half used
+int32_t drainDue(Window *slot, int32_t windowSize, int32_t bottomEdge) {
+	int32_t drainEvery = windowSize / 4 > 0 ? windowSize / 4 : 1;
+
+	return (int32_t) slot->seqNum - bottomEdge >= windowSize / 2 || slot->seqNum % drainEvery == 0;
+}
+
+//Sends (or resends) a Window slot and arms its retransmission timer
+void sendPacket(Window *slot, Connection *connection, TimerWheel *wheel, RttState *rtt) {
+	uint8_t packet[slot->buf_len + HEADER_LEN];
+	uint64_t now = timeNowMs();
+	int32_t backoff = slot->tries < 6 ? slot->tries : 6;
+	uint64_t timeout = rtt->rto << backoff;
+
+	if (slot->tries > 0) {
+		traceEvent(TRACE_RESEND, slot->seqNum, slot->flag, slot->buf_len, slot->tries);
+	}
+	send_buf(slot->buf, slot->buf_len, connection, slot->flag, slot->seqNum, packet);
+	slot->sendTime = now;
+	slot->tries++;
+	//Back off exponentially each time this packet has to go again, but never past
+	//MAX_RTO; the Server only lingers that long for a resent EOF
+	wheelAdd(wheel, &slot->timer, now + (timeout < MAX_RTO ? timeout : MAX_RTO));
+}
+
+//Take in every ACK already waiting, without blocking. RRs collapse into the highest one,
+//and the Window is cut to whatever the Server said it has room for alongside it.
+//Each SREJ is resent at most once a drain, and not again within an RTT of its last resend:
+//the Server repeats them for every packet past the hole until the resend lands.
+//Returns END_OF_FILE or RR_FLAG if either was seen, EOF_BAD if the Server's copy came out wrong.
+int32_t drainAcks(Window *winBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt) {
 	uint8_t packet[MAX_LEN] = {0};
-	uint8_t flag;
-	int32_t seqNum = 0;
-	if (recv_buf(packet, 1000, connection->sk_num, connection, &flag, &seqNum) != CRC_ERROR) {
-		memcpy(ack, packet, sizeof(uint32_t));
-		return flag;
+	uint8_t flag = 0;
+	int32_t seqNum = 0, recvLen = 0, result = 0;
+	uint32_t ack = 0, highest = 0, srejd = 0, rwnd = 0, rwndAck = 0;
+	Window *slot = NULL;
+	Connection from;
+
+	while ((recvLen = recv_buf_nowait(packet, MAX_LEN, connection->sk_num, &from, &flag, &seqNum)) != NO_PACKET) {
+		if (recvLen == CRC_ERROR || !sameAddr(&from.remote, &connection->remote)) {
+			//Corrupt, or from a session the Server started for a resent filename
+			continue;
+		}
+		memcpy(&ack, packet, sizeof(uint32_t));
+		if ((flag == RR_FLAG || flag == SREJ_FLAG) && recvLen >= 2 * sizeof(uint32_t) && ack >= rwndAck) {
+			//Receive Window, counted from this ACK. The newest one wins.
+			memcpy(&rwnd, packet + sizeof(uint32_t), sizeof(uint32_t));
+			rwnd = ntohl(rwnd);
+			rwndAck = ack;
+		}
+		if (flag == RR_FLAG && ack > highest) {
+			highest = ack;
+		}
+		else if (flag == SREJ_FLAG && ack >= highest && ack > srejd && (int32_t) ack >= *bottomEdge &&
+			(slot = &winBuf[ack % windowSize])->seqNum == ack) {
+			//SREJ. Everything below it arrived; resend the requested packet, unless an RR or SREJ already covered it.
+			traceEvent(TRACE_SREJ, ack, flag, 0, rwnd);
+			highest = ack;
+			srejd = ack;
+			if (slot->tries <= 1 || (int64_t) (timeNowMs() - slot->sendTime) >= rtt->srtt) {
+				sendPacket(slot, connection, wheel, rtt);
+			}
+		}
+		else if (flag == END_OF_FILE) {
+			result = END_OF_FILE;
+		}
+		else if (flag == EOF_BAD) {
+			//Server's copy didn't hash the same as ours
+			printf("File hash mismatch. The copy on the Server is corrupt.\n");
+			return EOF_BAD;
+		}
+	}
+
+	if (highest > 0) {
+		//RR. Move the window properly.
+		ackPackets(winBuf, windowSize, bottomEdge, upperEdge, highest, wheel, rtt);
+		if (result == 0) {
+			result = RR_FLAG;
+		}
+	}
+	if (rwndAck > 0 && (int32_t) rwndAck >= *bottomEdge) {
+		//Never past our own Window, nor past what the Server can take
+		*upperEdge = *bottomEdge + (rwnd < (uint32_t) windowSize ? rwnd : windowSize);
 	}
-	return CRC_ERROR;
+	return result;
 }
 
 //Adjust Window 
@@ -266,78 +994,389 @@ void updateWindow (int32_t windowSize, int32_t *bottomEdge, int32_t *upperEdge,
 	*upperEdge = *bottomEdge + windowSize;
 }
 
-//Window is Closed. Resend the Bottom
-STATE winClosed (Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, Window *windowBuf, int32_t windowSize, uint32_t *resendCnt) {
-	uint8_t packet[MAX_LEN] = {0};
-	int32_t resend = *bottomEdge % windowSize;
-	uint32_t ackNum, ackFlag;
-	int32_t index = 0;
+//Everything below ackNum arrived. Stop its timers, then slide the Window.
+void ackPackets(Window *winBuf, int32_t windowSize, int32_t *bottomEdge, int32_t *upperEdge, uint32_t ackNum,
+	TimerWheel *wheel, RttState *rtt) {
+	uint32_t seq = 0;
+	Window *slot = NULL;
+	int32_t resent = 0;
+
+	if ((int32_t) ackNum <= *bottomEdge) {
+		//Stale or duplicate RR
+		return;
+	}
+	for (seq = *bottomEdge; seq < ackNum; seq++) {
+		slot = &winBuf[seq % windowSize];
+		wheelCancel(wheel, &slot->timer);
+		resent |= (slot->tries > 1);
+		if (seq == ackNum - 1 && !resent) {
+			//Only time ACKs that weren't held up behind a resent packet (Karn's algorithm)
+			rttSample(rtt, timeNowMs() - slot->sendTime);
+		}
+	}
+	updateWindow(windowSize, bottomEdge, upperEdge, ackNum);
+}
+
+//Resend every packet whose timer ran out
+STATE checkTimers(Window *winBuf, Connection *connection, TimerWheel *wheel, RttState *rtt, STATE curState) {
+	TimerNode *expired = wheelAdvance(wheel, timeNowMs());
+	TimerNode *next = NULL;
+	Window *slot = NULL;
+
+	while (expired != NULL) {
+		next = expired->next;
+		slot = &winBuf[expired->index];
+		traceEvent(TRACE_TIMEOUT, slot->seqNum, slot->flag, slot->buf_len, slot->tries);
+		if (slot->tries >= MAX_TRIES) {
+			//Packet lost 10 times.
+			printf("Sent %d times. Terminating.\n", MAX_TRIES);
+			return DONE;
+		}
+		sendPacket(slot, connection, wheel, rtt);
+		expired = next;
+	}
+	return curState;
+}
+
+//Block until the Server says something or the next timer is due
+int32_t waitTimers(Connection *connection, TimerWheel *wheel) {
+	int64_t wait = wheelNextTimeout(wheel, timeNowMs());
+
+	if (wait < 0) {
+		wait = SHORT_TIME * 1000;
+	}
+	return selectCall(connection->sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL);
+}
+
+//Window is Closed. Wait for the Server, resending anything that times out
+STATE winClosed (Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, Window *windowBuf, int32_t windowSize,
+	TimerWheel *wheel, RttState *rtt) {
+	int32_t ackFlag = 0, ready = 0;
+	int64_t wait = 0;
+	static int32_t probes = 0;
 
-	//Blocking 1 second select 
-	if (selectCall(connection->sk_num, 0, 0, 1)) {
-      printf("Select true.\n");
-      ackFlag = getAck(connection, &ackNum);
+	if (*upperEdge <= *bottomEdge && wheel->count == 0) {
+		//Server's Window is shut and nothing is out. Probe on the RTO, backing off like a resend.
+		wait = rtt->rto << probes;
+		wait = wait < MAX_RTO ? wait : MAX_RTO;
+		ready = selectCall(connection->sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL);
+	}
+	else {
+		ready = waitTimers(connection, wheel);
+	}
+	if (ready) {
+		ackFlag = drainAcks(windowBuf, windowSize, connection, bottomEdge, upperEdge, wheel, rtt);
 		if (ackFlag == END_OF_FILE) {
 			//ACK returns EOF
 			return END_DATA;
 		}
-		else if (ackFlag == SREJ_FLAG) {
-			//SREJ. Return requested Packet
-			index = ackNum % windowSize;
-			send_buf(windowBuf[index].buf, windowBuf[index].buf_len, connection, windowBuf[index].flag, windowBuf[index].seqNum, packet);
-			*resendCnt = 0;
-			return WIN_CLOSED;
+		else if (ackFlag == EOF_BAD) {
+			return RESEND;
 		}
 		else if (ackFlag == RR_FLAG) {
-			//RR. Update Window, then return to SEND_DATA state
-			updateWindow(windowSize, bottomEdge, upperEdge, ackNum);
-			*resendCnt = 0;
-			return SEND_DATA;
+			//RR. Window moved (or reopened), return to SEND_DATA state
+			probes = 0;
+			return checkTimers(windowBuf, connection, wheel, rtt, SEND_DATA);
 		}
-		return WIN_CLOSED;
 	}
-	else {
-		//Resend lowest thing in the Window; increment the resend Counter
-		send_buf(windowBuf[resend].buf, windowBuf[resend].buf_len, connection, windowBuf[resend].flag, windowBuf[resend].seqNum, packet);
-		(*resendCnt)++;
-		return WIN_CLOSED;
+	else if (*upperEdge <= *bottomEdge && wheel->count == 0) {
+		//Its reopening RR may have been lost; ask.
+		if (++probes > MAX_TRIES) {
+			printf("Server's window stayed closed. Terminating.\n");
+			return DONE;
+		}
+		probeWindow(connection, *bottomEdge);
 	}
-	return DONE;
+	return checkTimers(windowBuf, connection, wheel, rtt, WIN_CLOSED);
+}
+
+//Zero Window probe. The Server answers with an RR carrying its current Window.
+void probeWindow(Connection *connection, int32_t bottomEdge) {
+	uint8_t packet[MAX_LEN];
+
+	send_buf(NULL, 0, connection, WIN_PROBE_FLAG, bottomEdge, packet);
 }
 
 //Last Packet to be sent from rCopy
-STATE lastPacket (Window *windowBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge, uint32_t *lastCnt) {
-	int32_t recv_flag, resend;
-	uint32_t ack, resendPacket;
-	uint8_t packet[MAX_LEN] = {0};
+STATE lastPacket (Window *windowBuf, int32_t windowSize, Connection *connection, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt) {
+	int32_t ackFlag = 0;
 
-	//1-second Blocking Select
-	if (selectCall(connection->sk_num, SHORT_TIME, 0, 1)) {
-		recv_flag = getAck(connection, &ack);
-		if (recv_flag == END_OF_FILE) {
-			//EOF ACK has been received. Terminate Client.
-			return DONE;
+	if (waitTimers(connection, wheel) &&
+		(ackFlag = drainAcks(windowBuf, windowSize, connection, bottomEdge, upperEdge, wheel, rtt)) == END_OF_FILE) {
+		//EOF ACK has been received. Terminate Client.
+		return DONE;
+	}
+	if (ackFlag == EOF_BAD) {
+		return RESEND;
+	}
+	//Anything the Server still hasn't got (the last packet included) goes again once its timer runs out
+	return checkTimers(windowBuf, connection, wheel, rtt, END_DATA);
+}
+
+//Multicast: Send the Remote File Name to the group and collect the receivers that answer
+STATE joinGroup (char *filename, int32_t *bufSize, int32_t *windowSize, Connection *server, Group *group, int32_t minReceivers) {
+	uint8_t packet[MAX_LEN];
+	uint8_t buf[MAX_LEN];
+	uint8_t flag = 0;
+	int32_t seqNum = 0, round = 0, joined = 0, receiver = 0;
+	int32_t nameLength = strlen(filename) + 1;
+	int64_t wait = 0;
+	uint64_t deadline = 0;
+	Connection from;
+	Receiver *newReceiver = NULL;
+	uint32_t accepted = htonl(*bufSize), window = htonl(*windowSize);
+	int32_t recvLen = 0;
+
+	memcpy(buf, &accepted, SIZE_OF_BUF_SIZE);
+	memcpy(&buf[4], &window, 4);
+	memcpy(&buf[8], filename, nameLength);
+
+	for (round = 0; round < MAX_TRIES; round++) {
+		send_buf(buf, nameLength+8, server, REMOTE_FN_FLAG, 0, packet);
+		joined = 0;
+		deadline = timeNowMs() + SHORT_TIME * 1000;
+
+		while ((minReceivers == 0 || group->count < minReceivers) &&
+			(wait = deadline - timeNowMs()) > 0 && selectCall(server->sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL)) {
+			if ((recvLen = recv_buf(packet, MAX_LEN, server->sk_num, &from, &flag, &seqNum)) == CRC_ERROR) {
+				continue;
+			}
+			receiver = findReceiver(group, &from.remote);
+			if (flag == FN_GOOD && receiver < 0 && group->count < MAX_RECEIVERS) {
+				//Everyone gets the smallest payload and Window any receiver accepted
+				if (recvLen >= SIZE_OF_BUF_SIZE) {
+					memcpy(&accepted, packet, SIZE_OF_BUF_SIZE);
+					if ((int32_t) ntohl(accepted) < *bufSize) {
+						*bufSize = ntohl(accepted);
+					}
+				}
+				if (recvLen >= FN_GOOD_LEN) {
+					memcpy(&window, packet + SIZE_OF_BUF_SIZE + 1, SIZE_OF_BUF_SIZE);
+					if ((int32_t) ntohl(window) > 0 && (int32_t) ntohl(window) < *windowSize) {
+						*windowSize = ntohl(window);
+					}
+				}
+				newReceiver = &group->receivers[group->count++];
+				newReceiver->addr = from.remote;
+				newReceiver->ack = START_SEQ_NUM;
+				newReceiver->rwnd = *windowSize;
+				newReceiver->lastHeard = timeNowMs();
+				newReceiver->active = 1;
+				newReceiver->done = 0;
+				printf("Receiver %s:%d joined.\n", inet_ntoa(from.remote.sin_addr), ntohs(from.remote.sin_port));
+				joined++;
+			}
+			else if (flag == FN_BAD && receiver < 0) {
+				printf("Error during file open of %s on receiver %s:%d.\n", filename,
+					inet_ntoa(from.remote.sin_addr), ntohs(from.remote.sin_port));
+			}
 		}
-		else if (recv_flag == SREJ_FLAG) {
-			//Server still missing packets. Resend requested packet.
-			resendPacket = ack % windowSize;
-			send_buf(windowBuf[resendPacket].buf, windowBuf[resendPacket].buf_len, connection,
-				windowBuf[resendPacket].flag, windowBuf[resendPacket].seqNum, packet);
-			*lastCnt = 0;
-		}
-		else if (recv_flag == RR_FLAG) {
-			//Move the Window.
-			updateWindow(windowSize, bottomEdge, upperEdge, ack);
-			*lastCnt = 0;
-			return END_DATA;
+		if (minReceivers > 0 ? group->count >= minReceivers : (group->count > 0 && joined == 0)) {
+			//Everyone asked for is here, or a whole round went by with no one new
+			break;
 		}
-		else {
+	}
+
+	if (group->count == 0 || group->count < minReceivers) {
+		printf("Only %d receiver(s) joined the group. Terminating.\n", group->count);
+		return DONE;
+	}
+	for (receiver = 0; receiver < group->count; receiver++) {
+		//Those that joined first were told a bigger Window
+		group->receivers[receiver].rwnd = *windowSize;
+	}
+	return SEND_DATA;
+}
+
+//Multicast: Sends Packet to the group, then takes in anything a receiver sent
+STATE groupSendData(Window *winBuf, int32_t windowSize, Connection *server, Group *group, int32_t index,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt) {
+	if (index >= 0) {
+		sendPacket(&winBuf[index], server, wheel, rtt);
+
+		if (winBuf[index].flag == END_OF_FILE) {
+			//Sent Last Packet, go to END_DATA State
 			return END_DATA;
 		}
+		if (!drainDue(&winBuf[index], windowSize, *bottomEdge)) {
+			return checkTimers(winBuf, server, wheel, rtt, SEND_DATA);
+		}
+	}
+	else if (!selectCall(server->sk_num, INSTANT_TIME, RING_WAIT_USEC, NOT_NULL)) {
+		return checkTimers(winBuf, server, wheel, rtt, SEND_DATA);
+	}
+
+	groupAck(winBuf, windowSize, server, group, bottomEdge, upperEdge, wheel, rtt);
+	return checkTimers(winBuf, server, wheel, rtt, SEND_DATA);
+}
+
+//Multicast: Window closed or last packet sent. Wait on the slowest receiver.
+STATE groupWait(Window *winBuf, int32_t windowSize, Connection *server, Group *group,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt, STATE curState) {
+	int32_t oldUpper = *upperEdge, ready = 0;
+	int64_t wait = 0;
+	static int32_t probes = 0;
+
+	if (*upperEdge <= *bottomEdge && wheel->count == 0) {
+		//Some receiver's Window is shut and nothing is out. Probe the group on the RTO, backing off.
+		wait = rtt->rto << probes;
+		wait = wait < MAX_RTO ? wait : MAX_RTO;
+		if (!(ready = selectCall(server->sk_num, wait / 1000, (wait % 1000) * 1000, NOT_NULL))) {
+			probes += (probes < MAX_TRIES);
+			probeWindow(server, *bottomEdge);
+		}
+	}
+	else {
+		ready = waitTimers(server, wheel);
+	}
+	if (ready) {
+		groupAck(winBuf, windowSize, server, group, bottomEdge, upperEdge, wheel, rtt);
+	}
+	if (groupCheck(winBuf, windowSize, group, bottomEdge, upperEdge, wheel, rtt) == 0) {
+		//Every receiver is finished or gone
+		return DONE;
+	}
+	if (curState == WIN_CLOSED && *upperEdge > oldUpper) {
+		probes = 0;
+		curState = SEND_DATA;
+	}
+	return checkTimers(winBuf, server, wheel, rtt, curState);
+}
+
+//Multicast: Take in every waiting RR/SREJ/EOF ACK. The Window only slides as far as the slowest receiver.
+void groupAck(Window *winBuf, int32_t windowSize, Connection *server, Group *group,
+	int32_t *bottomEdge, int32_t *upperEdge, TimerWheel *wheel, RttState *rtt) {
+	uint8_t packet[MAX_LEN] = {0};
+	uint8_t flag = 0;
+	int32_t seqNum = 0, receiver = 0;
+	uint32_t ack = 0;
+	Connection from;
+
+	int32_t recvLen = 0;
+
+	while ((recvLen = recv_buf_nowait(packet, 1000, server->sk_num, &from, &flag, &seqNum)) != NO_PACKET) {
+		if (recvLen == CRC_ERROR) {
+			continue;
+		}
+		if ((receiver = findReceiver(group, &from.remote)) < 0 || !group->receivers[receiver].active) {
+			continue;
+		}
+		memcpy(&ack, packet, sizeof(uint32_t));
+		group->receivers[receiver].lastHeard = timeNowMs();
+
+		if ((flag == RR_FLAG || flag == SREJ_FLAG) && recvLen >= 2 * sizeof(uint32_t) && ack >= group->receivers[receiver].ack) {
+			//This receiver's Window, counted from its ACK
+			memcpy(&group->receivers[receiver].rwnd, packet + sizeof(uint32_t), sizeof(uint32_t));
+			group->receivers[receiver].rwnd = ntohl(group->receivers[receiver].rwnd);
+		}
+		if (flag == RR_FLAG && ack > group->receivers[receiver].ack) {
+			group->receivers[receiver].ack = ack;
+		}
+		else if (flag == END_OF_FILE || flag == EOF_BAD) {
+			group->receivers[receiver].ack = ack;
+			if (flag == EOF_BAD && !group->receivers[receiver].done) {
+				printf("File hash mismatch. The copy on receiver %s:%d is corrupt.\n",
+					inet_ntoa(from.remote.sin_addr), ntohs(from.remote.sin_port));
+				group->corrupt++;
+			}
+			group->receivers[receiver].done = 1;
+		}
+		else if (flag == SREJ_FLAG) {
+			//SREJs are cumulative too, since receivers may hold back their RRs
+			if (ack > group->receivers[receiver].ack) {
+				group->receivers[receiver].ack = ack;
+			}
+			repairPacket(winBuf, windowSize, server, group, receiver, ack, wheel, rtt);
+		}
+	}
+	groupCheck(winBuf, windowSize, group, bottomEdge, upperEdge, wheel, rtt);
+}
+
+//Multicast: Repair one receiver directly, or the whole group once enough of them are missing it
+void repairPacket(Window *winBuf, int32_t windowSize, Connection *server, Group *group, int32_t receiver,
+	uint32_t seq, TimerWheel *wheel, RttState *rtt) {
+	Window *slot = &winBuf[seq % windowSize];
+	uint8_t packet[slot->buf_len + HEADER_LEN];
+	uint64_t now = timeNowMs();
+	Connection to;
+
+	if (slot->seqNum != seq) {
+		return;
+	}
+	traceEvent(TRACE_SREJ, seq, SREJ_FLAG, 0, receiver);
+	if (now - slot->nakTime > rtt->rto) {
+		//Start a new round of repairs for this packet
+		slot->nakMask = 0;
+		slot->nakTime = now;
+	}
+	if (slot->nakMask & MC_REPAIRED) {
+		//Group repair is already on its way
+		return;
+	}
+	slot->nakMask |= 1ULL << receiver;
+
+	if (__builtin_popcountll(slot->nakMask) >= MC_MULTICAST_REPAIR) {
+		sendPacket(slot, server, wheel, rtt);
+		slot->nakMask = MC_REPAIRED;
+	}
+	else {
+		to = *server;
+		to.remote = group->receivers[receiver].addr;
+		traceEvent(TRACE_RESEND, slot->seqNum, slot->flag, slot->buf_len, slot->tries);
+		send_buf(slot->buf, slot->buf_len, &to, slot->flag, slot->seqNum, packet);
+		slot->tries++;
+	}
+}
+
+//Multicast: Drop receivers that went quiet, then slide the Window to the slowest one left.
+//Returns how many receivers still have data coming.
+int32_t groupCheck(Window *winBuf, int32_t windowSize, Group *group, int32_t *bottomEdge, int32_t *upperEdge,
+	TimerWheel *wheel, RttState *rtt) {
+	Receiver *receiver = NULL;
+	uint32_t slowest = UINT32_MAX, edge = UINT32_MAX;
+	uint64_t now = timeNowMs();
+	int32_t index = 0, pending = 0;
+
+	for (index = 0; index < group->count; index++) {
+		receiver = &group->receivers[index];
+		if (!receiver->active) {
+			continue;
+		}
+		if (!receiver->done && now - receiver->lastHeard > LONG_TIME * 1000) {
+			printf("Receiver %s:%d dropped; nothing heard for %d seconds.\n",
+				inet_ntoa(receiver->addr.sin_addr), ntohs(receiver->addr.sin_port), LONG_TIME);
+			receiver->active = 0;
+			continue;
+		}
+		if (receiver->ack < slowest) {
+			slowest = receiver->ack;
+		}
+		if (!receiver->done) {
+			pending++;
+			if (receiver->ack + receiver->rwnd < edge) {
+				edge = receiver->ack + receiver->rwnd;
+			}
+		}
+	}
+	if (slowest != UINT32_MAX) {
+		ackPackets(winBuf, windowSize, bottomEdge, upperEdge, slowest, wheel, rtt);
+	}
+	if (edge != UINT32_MAX) {
+		//Only as far as the fullest receiver can take
+		*upperEdge = (int32_t) edge < *bottomEdge + windowSize ? (int32_t) edge : *bottomEdge + windowSize;
+	}
+	return pending;
+}
+
+int32_t findReceiver(Group *group, struct sockaddr_in *addr) {
+	int32_t index = 0;
+
+	for (index = 0; index < group->count; index++) {
+		if (group->receivers[index].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+			group->receivers[index].addr.sin_port == addr->sin_port) {
+			return index;
+		}
 	}
-	//Server didn't get last packet. Resend packet; increment counter.
-	resend = *bottomEdge % windowSize;
-	send_buf(windowBuf[resend].buf, windowBuf[resend].buf_len, connection, windowBuf[resend].flag, windowBuf[resend].seqNum, packet);
-	(*lastCnt)++;
-	return END_DATA;
+	return -1;
 }
@@ -0,0 +1,163 @@
+/*
+ * The Server's reorder buffer. Packets that arrive past a hole wait
+ * here until it is filled; an occupancy bitmap finds duplicates in
+ * one bit test and the run behind a filled hole a word at a time,
+ * so it stays cheap with Windows of 100K+ packets. Their payloads
+ * are borrowed from the Pool only for as long as they wait.
+ */
+#include "networks.h"
+#include "reorder.h"
+
+#define WORD_BITS 64
+
+static size_t reorderBytes(int32_t windowSize);
+
+//What a Window's slots and bitmap take
+static size_t reorderBytes(int32_t windowSize) {
+	return (size_t) windowSize * sizeof(Held) + (size_t) (windowSize + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t);
+}
+
+//Largest Window up to windowSize the Pool's budget covers: the bookkeeping for it, and a buffer for every
+//packet it could hold past a hole. The first packet past the last ACK never needs one.
+//A bigger Window costs more bookkeeping and leaves less for buffers, so search for where they meet.
+int32_t reorderFit(Pool *pool, int32_t windowSize, int32_t bufSize) {
+	int32_t low = 1, high = windowSize, middle = 0;
+
+	while (low < high) {
+		middle = low + (high - low + 1) / 2;
+		if (poolCapacity(pool, bufSize, reorderBytes(middle)) >= (uint32_t) middle - 1) {
+			low = middle;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+	return low;
+}
+
+void reorderInit(Reorder *reorder, Pool *pool, int32_t windowSize, int32_t bufSize) {
+	reorder->slots = calloc(windowSize, sizeof(Held));
+	reorder->bitmap = calloc((windowSize + WORD_BITS - 1) / WORD_BITS, sizeof(uint64_t));
+	if (reorder->slots == NULL || reorder->bitmap == NULL) {
+		perror("reorderInit, calloc");
+		exit(-1);
+	}
+	reorder->pool = pool;
+	reorder->windowSize = windowSize;
+	reorder->bufSize = bufSize;
+	reorder->count = 0;
+	reorder->member = poolJoin(pool, reorderBytes(windowSize), &reorder->reserved);
+}
+
+//Give back whatever is still held; a Session that ends mid hole has some. Nothing to do if it never started.
+void reorderFree(Reorder *reorder) {
+	uint32_t word = 0;
+	uint64_t bits = 0;
+
+	if (reorder->slots == NULL) {
+		return;
+	}
+	for (word = 0; word < (reorder->windowSize + WORD_BITS - 1) / WORD_BITS; word++) {
+		for (bits = reorder->bitmap[word]; bits != 0; bits &= bits - 1) {
+			poolPut(reorder->pool, reorder->slots[word * WORD_BITS + __builtin_ctzll(bits)].buf);
+		}
+	}
+	poolLeave(reorder->pool, reorder->member, reorder->reserved);
+	free(reorder->slots);
+	free(reorder->bitmap);
+	reorder->slots = NULL;
+	reorder->bitmap = NULL;
+}
+
+//Hold a packet that arrived ahead of expected. Returns 1 if it is new, 0 for a duplicate,
+//anything past the Window, which would land on a slot still in use, or when the Pool is used up.
+int32_t reorderStore(Reorder *reorder, int32_t expected, int32_t seqNum, uint8_t *buf, int32_t len, uint8_t flag) {
+	uint32_t index = seqNum % reorder->windowSize;
+	uint64_t bit = 1ULL << (index % WORD_BITS);
+	Held *slot = &reorder->slots[index];
+
+	if (seqNum <= expected || seqNum - expected >= reorder->windowSize || (reorder->bitmap[index / WORD_BITS] & bit)) {
+		return 0;
+	}
+	if ((slot->buf = poolGet(reorder->pool, reorder->bufSize)) == NULL) {
+		return 0;
+	}
+	memcpy(slot->buf, buf, len);
+	slot->len = len;
+	slot->flag = flag;
+	reorder->bitmap[index / WORD_BITS] |= bit;
+	reorder->count++;
+	return 1;
+}
+
+//How many packets from seqNum on are held back to back. seqNum + the run is the next hole.
+uint32_t reorderRun(Reorder *reorder, int32_t seqNum) {
+	uint32_t index = seqNum % reorder->windowSize, run = 0, span = 0, missing = 0;
+	uint64_t empty = 0;
+
+	while (run < reorder->count) {
+		//Clear bits from index on, up to the end of the word or of the Window
+		empty = ~(reorder->bitmap[index / WORD_BITS] >> (index % WORD_BITS));
+		span = WORD_BITS - index % WORD_BITS;
+		span = span < reorder->windowSize - index ? span : reorder->windowSize - index;
+		if (empty != 0 && (missing = __builtin_ctzll(empty)) < span) {
+			return run + missing;
+		}
+		run += span;
+		index = (index + span) % reorder->windowSize;
+	}
+	return reorder->count;
+}
+
+//The held packet with this seqNum. Only meaningful within a run.
+Held *reorderSlot(Reorder *reorder, int32_t seqNum) {
+	return &reorder->slots[seqNum % reorder->windowSize];
+}
+
+//A run went to the writer; free its slots and give their buffers back
+void reorderRelease(Reorder *reorder, int32_t seqNum, uint32_t count) {
+	uint32_t index = seqNum % reorder->windowSize, span = 0, slot = 0;
+	uint64_t mask = 0;
+
+	reorder->count -= count;
+	while (count > 0) {
+		span = WORD_BITS - index % WORD_BITS;
+		span = span < reorder->windowSize - index ? span : reorder->windowSize - index;
+		span = span < count ? span : count;
+		mask = span == WORD_BITS ? ~0ULL : ((1ULL << span) - 1) << (index % WORD_BITS);
+		reorder->bitmap[index / WORD_BITS] &= ~mask;
+		for (slot = index; slot < index + span; slot++) {
+			poolPut(reorder->pool, reorder->slots[slot].buf);
+		}
+		count -= span;
+		index = (index + span) % reorder->windowSize;
+	}
+}
+
+//Packets past a hole this Session could hold right now: those it has, and its share of the Pool
+uint32_t reorderRoom(Reorder *reorder) {
+	return reorder->count + poolShare(reorder->pool, reorder->bufSize);
+}
+
+//A packet arrived. In order, it goes out with the run it uncovered, and expected moves past them all;
+//past a hole, it's held. The Server's receive path without the socket or ACKs, so the benchmarks run it too.
+int32_t reorderArrive(Reorder *reorder, Outlet *outlet, int32_t *expected, int32_t seqNum, uint8_t *buf, int32_t len,
+	uint8_t flag) {
+	uint32_t run = 0;
+	int32_t eof = 0;
+
+	if (seqNum < *expected) {
+		return ARRIVED_OLD;
+	}
+	if (seqNum > *expected) {
+		return reorderStore(reorder, *expected, seqNum, buf, len, flag) ? ARRIVED_HELD : ARRIVED_DROPPED;
+	}
+	eof = outlet->one(outlet->arg, buf, len, flag);
+	(*expected)++;
+	if (!eof && reorder->count > 0) {
+		run = reorderRun(reorder, *expected);
+		eof = outlet->run(outlet->arg, reorder, *expected, run);
+		*expected += run;
+	}
+	return eof ? ARRIVED_EOF : ARRIVED_NEXT;
+}
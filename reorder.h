@@ -0,0 +1,59 @@
+#ifndef _REORDER_H_
+#define _REORDER_H_
+
+#include <stdint.h>
+
+#include "networks.h"
+#include "pool.h"
+
+//Struct Declaration for a Packet held in the Reorder Buffer. buf is borrowed from the Pool.
+typedef struct {
+	uint8_t *buf;
+	int32_t len;
+	uint8_t flag;
+} Held;
+
+//Struct Declaration for the Server's Reorder Buffer.
+//A packet that arrives ahead of a hole waits in slot seqNum % windowSize. A bit per slot says
+//which are full, so duplicates, runs and holes are found a 64 bit word at a time.
+//Only full slots have a buffer, taken from the Pool when the packet arrives and given back once it's written.
+//Only seqNums from expected to expected + windowSize - 1 are ever held, so a set bit is never stale.
+//The slots and bitmap are charged to the Pool's budget as reserved Slabs. member is what the Pool knows it as.
+typedef struct {
+	Held *slots;
+	uint64_t *bitmap;
+	Pool *pool;
+	int32_t member;
+	uint32_t reserved;
+	int32_t windowSize;
+	int32_t bufSize;
+	uint32_t count;
+} Reorder;
+
+//What became of a packet given to reorderArrive
+#define ARRIVED_NEXT 0
+#define ARRIVED_EOF 1
+#define ARRIVED_HELD 2
+#define ARRIVED_DROPPED 3
+#define ARRIVED_OLD 4
+
+//Struct Declaration for where in-order packets go. one takes a single packet, run the count held from seqNum on,
+//which it releases from the Reorder Buffer. Each returns 1 if what it took ended with the EOF.
+typedef struct {
+	int32_t (*one)(void *arg, uint8_t *buf, int32_t len, uint8_t flag);
+	int32_t (*run)(void *arg, Reorder *reorder, int32_t seqNum, uint32_t count);
+	void *arg;
+} Outlet;
+
+//Headers for Functions in reorder.c
+int32_t reorderFit(Pool *pool, int32_t windowSize, int32_t bufSize);
+void reorderInit(Reorder *reorder, Pool *pool, int32_t windowSize, int32_t bufSize);
+void reorderFree(Reorder *reorder);
+int32_t reorderStore(Reorder *reorder, int32_t expected, int32_t seqNum, uint8_t *buf, int32_t len, uint8_t flag);
+uint32_t reorderRun(Reorder *reorder, int32_t seqNum);
+Held *reorderSlot(Reorder *reorder, int32_t seqNum);
+void reorderRelease(Reorder *reorder, int32_t seqNum, uint32_t count);
+uint32_t reorderRoom(Reorder *reorder);
+int32_t reorderArrive(Reorder *reorder, Outlet *outlet, int32_t *expected, int32_t seqNum, uint8_t *buf, int32_t len,
+	uint8_t flag);
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Lock free single producer/single consumer Ring of payload
+ * buffers. Used to hand file data between the disk thread and
+ * the network thread without either one blocking the other.
+ */
+#include "networks.h"
+#include "ring.h"
+
+//Allocate depth payload buffers (depth rounded up to a power of 2)
+int32_t ringInit(Ring *ring, uint32_t depth, int32_t bufSize) {
+	uint32_t index = 0;
+
+	ring->depth = 1;
+	while (ring->depth < depth && ring->depth < MAX_RING_DEPTH) {
+		ring->depth <<= 1;
+	}
+	ring->mask = ring->depth - 1;
+	ring->bufSize = bufSize;
+	ring->head = 0;
+	ring->tail = 0;
+
+	ring->slots = calloc(ring->depth, sizeof(RingSlot));
+	ring->payload = malloc((size_t) ring->depth * bufSize);
+	if (ring->slots == NULL || ring->payload == NULL) {
+		ringFree(ring);
+		return -1;
+	}
+	for (index = 0; index < ring->depth; index++) {
+		ring->slots[index].buf = ring->payload + (size_t) index * bufSize;
+	}
+	return 0;
+}
+
+void ringFree(Ring *ring) {
+	free(ring->slots);
+	free(ring->payload);
+	ring->slots = NULL;
+	ring->payload = NULL;
+}
+
+//Producer: next free slot, or NULL if the Ring is full
+RingSlot *ringProduce(Ring *ring) {
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail == ring->depth) {
+		return NULL;
+	}
+	return &ring->slots[ring->head & ring->mask];
+}
+
+//Producer: hand the filled slot over to the consumer
+void ringPublish(Ring *ring) {
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+//Producer: how many slots are free
+uint32_t ringRoom(Ring *ring) {
+	return ring->depth - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+//Producer: the free slot offset places past the next one. offset must be below ringRoom().
+RingSlot *ringProduceAt(Ring *ring, uint32_t offset) {
+	return &ring->slots[(ring->head + offset) & ring->mask];
+}
+
+//Producer: hand count filled slots over at once
+void ringPublishRun(Ring *ring, uint32_t count) {
+	__atomic_store_n(&ring->head, ring->head + count, __ATOMIC_RELEASE);
+}
+
+//Consumer: oldest filled slot, or NULL if the Ring is empty
+RingSlot *ringConsume(Ring *ring) {
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == ring->tail) {
+		return NULL;
+	}
+	return &ring->slots[ring->tail & ring->mask];
+}
+
+//Consumer: give the slot back to the producer
+void ringRelease(Ring *ring) {
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+//Filled slots; exact from either side's own point of view
+uint32_t ringCount(Ring *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+void ringWait(void) {
+	usleep(RING_WAIT_USEC);
+}
@@ -0,0 +1,49 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+#include "networks.h"
+
+//Default and Maximum Number of Payload Buffers in a Ring. The Server's is never shallower than its Window.
+#define DEFAULT_RING_DEPTH 256
+#define MAX_RING_DEPTH MAX_WINDOW
+
+//How long a side sleeps when the Ring is full/empty (usec)
+#define RING_WAIT_USEC 200
+
+#define CACHE_LINE 64
+
+//Struct Declaration for a Ring Slot
+typedef struct {
+	uint32_t seqNum;
+	int32_t buf_len;
+	uint8_t flag;
+	uint8_t *buf;
+} RingSlot;
+
+//Struct Declaration for a single producer/single consumer Ring.
+//head is only written by the producer, tail only by the consumer.
+typedef struct {
+	RingSlot *slots;
+	uint8_t *payload;
+	uint32_t depth;
+	uint32_t mask;
+	int32_t bufSize;
+	uint32_t head __attribute__((aligned(CACHE_LINE)));
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));
+} Ring;
+
+//Headers for Functions in ring.c
+int32_t ringInit(Ring *ring, uint32_t depth, int32_t bufSize);
+void ringFree(Ring *ring);
+RingSlot *ringProduce(Ring *ring);
+void ringPublish(Ring *ring);
+uint32_t ringRoom(Ring *ring);
+RingSlot *ringProduceAt(Ring *ring, uint32_t offset);
+void ringPublishRun(Ring *ring, uint32_t count);
+RingSlot *ringConsume(Ring *ring);
+void ringRelease(Ring *ring);
+uint32_t ringCount(Ring *ring);
+void ringWait(void);
+#endif
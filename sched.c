@@ -0,0 +1,210 @@
+/*
+ * The Server's ingest scheduler. Sessions ask it for bytes before
+ * offering rCopy a Window to send them in; it shares out what the
+ * Server may take in by deficit round robin, weighted by each
+ * Session's priority class. A Session that gets nothing advertises
+ * a shut Window, so rCopy is paced by our ACKs.
+ */
+#include <sys/mman.h>
+
+#include "networks.h"
+#include "sched.h"
+
+static void schedLock(Sched *sched);
+static void schedRun(Sched *sched, uint64_t now);
+static void schedNext(Sched *sched);
+static void fill(uint64_t *tokens, uint64_t *filled, uint64_t rate, uint64_t now);
+static uint64_t depth(uint64_t rate);
+
+//Make the Scheduler in memory shared with every child forked after this
+Sched *schedInit(uint64_t rate, uint64_t sessionRate) {
+	pthread_mutexattr_t attr;
+	Sched *sched = mmap(NULL, sizeof(Sched), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (sched == MAP_FAILED) {
+		perror("schedInit, mmap");
+		exit(-1);
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&sched->lock, &attr) != 0) {
+		perror("schedInit, pthread_mutex_init");
+		exit(-1);
+	}
+	pthread_mutexattr_destroy(&attr);
+	sched->rate = rate;
+	sched->sessionRate = sessionRate;
+	sched->tokens = 0;
+	sched->filled = timeNowUs();
+	sched->next = 0;
+	sched->turn = 0;
+	//The last Flow is shared by any Sessions past MAX_FLOWS
+	sched->flows[MAX_FLOWS - 1].weight = SCHED_WEIGHT(PRIORITY_NORMAL);
+	return sched;
+}
+
+//A Session starts. Returns the Flow it's scheduled as.
+int32_t schedJoin(Sched *sched, uint32_t priority) {
+	int32_t flow = 0;
+	Flow *joined = NULL;
+
+	schedLock(sched);
+	for (flow = 0; flow < MAX_FLOWS - 1 && sched->flows[flow].users > 0; flow++) {}
+	joined = &sched->flows[flow];
+	if (joined->users++ == 0) {
+		joined->pid = getpid();
+		joined->weight = SCHED_WEIGHT(priority);
+		joined->deficit = 0;
+		joined->demand = 0;
+		joined->granted = 0;
+		joined->tokens = 0;
+		joined->filled = timeNowUs();
+	}
+	pthread_mutex_unlock(&sched->lock);
+	return flow;
+}
+
+void schedLeave(Sched *sched, int32_t flow) {
+	Flow *left = &sched->flows[flow];
+
+	schedLock(sched);
+	if (--left->users == 0) {
+		left->pid = 0;
+		left->demand = 0;
+		left->granted = 0;
+	}
+	pthread_mutex_unlock(&sched->lock);
+}
+
+//A child exited. If it died before leaving, free its Flow so nothing more is granted to it.
+void schedReap(Sched *sched, pid_t pid) {
+	int32_t flow = 0;
+
+	schedLock(sched);
+	for (flow = 0; flow < MAX_FLOWS - 1; flow++) {
+		if (sched->flows[flow].users > 0 && sched->flows[flow].pid == pid) {
+			sched->flows[flow].users = 0;
+			sched->flows[flow].pid = 0;
+			sched->flows[flow].demand = 0;
+			sched->flows[flow].granted = 0;
+		}
+	}
+	pthread_mutex_unlock(&sched->lock);
+}
+
+//Ask for want bytes. Returns what this Flow may take in now, which may be none of it.
+uint64_t schedTake(Sched *sched, int32_t flow, uint64_t want) {
+	Flow *taker = &sched->flows[flow];
+	uint64_t taken = 0;
+
+	schedLock(sched);
+	taker->demand = want > taker->granted ? want : taker->granted;
+	schedRun(sched, timeNowUs());
+	taken = taker->granted < want ? taker->granted : want;
+	taker->granted -= taken;
+	taker->demand -= taken;
+	pthread_mutex_unlock(&sched->lock);
+	return taken;
+}
+
+//Most a Flow can be granted in one go: the depth of the smaller bucket holding it back.
+//Waiting for more than that before taking any would wait forever.
+uint64_t schedBurst(Sched *sched) {
+	uint64_t most = sched->rate > 0 ? depth(sched->rate) : UINT64_MAX;
+
+	if (sched->sessionRate > 0 && depth(sched->sessionRate) < most) {
+		most = depth(sched->sessionRate);
+	}
+	return most;
+}
+
+//A Session killed mid-update leaves the lock to the next one; carry on with it
+static void schedLock(Sched *sched) {
+	if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&sched->lock);
+	}
+}
+
+//Share out what's come in since the last run. Each Flow still wanting more gets its weight in quanta
+//per turn; what it couldn't use carries to its next turn, unless it stops wanting any.
+//A turn cut short by the Server's tokens running out carries on at the next run, or small runs
+//would just alternate between Flows whatever their weights. Stops once a whole round grants nothing.
+static void schedRun(Sched *sched, uint64_t now) {
+	Flow *flow = NULL;
+	uint64_t give = 0;
+	uint32_t idle = 0;
+
+	if (sched->rate > 0) {
+		fill(&sched->tokens, &sched->filled, sched->rate, now);
+	}
+	while (idle < MAX_FLOWS && (sched->rate == 0 || sched->tokens > 0)) {
+		flow = &sched->flows[sched->next];
+		if (flow->users == 0 || flow->granted >= flow->demand) {
+			flow->deficit = 0;
+			schedNext(sched);
+			idle++;
+			continue;
+		}
+		if (sched->sessionRate > 0) {
+			fill(&flow->tokens, &flow->filled, sched->sessionRate, now);
+			if (flow->tokens == 0) {
+				//At its own limit; its turn doesn't count
+				schedNext(sched);
+				idle++;
+				continue;
+			}
+		}
+		if (!sched->turn) {
+			flow->deficit += SCHED_QUANTUM * flow->weight;
+			sched->turn = 1;
+		}
+		give = flow->demand - flow->granted < flow->deficit ? flow->demand - flow->granted : flow->deficit;
+		give = sched->rate > 0 && sched->tokens < give ? sched->tokens : give;
+		give = sched->sessionRate > 0 && flow->tokens < give ? flow->tokens : give;
+		flow->granted += give;
+		flow->deficit -= give;
+		if (sched->rate > 0) {
+			sched->tokens -= give;
+		}
+		if (sched->sessionRate > 0) {
+			flow->tokens -= give;
+		}
+		if (flow->granted >= flow->demand) {
+			flow->deficit = 0;
+		}
+		if (flow->deficit == 0 || flow->granted >= flow->demand || (sched->sessionRate > 0 && flow->tokens == 0)) {
+			schedNext(sched);
+		}
+		idle = 0;
+	}
+}
+
+//On to the next Flow's turn
+static void schedNext(Sched *sched) {
+	sched->next = (sched->next + 1) % MAX_FLOWS;
+	sched->turn = 0;
+}
+
+//Token bucket: rate bytes/sec, holding no more than depth(rate)
+static void fill(uint64_t *tokens, uint64_t *filled, uint64_t rate, uint64_t now) {
+	uint64_t most = depth(rate), elapsed = now > *filled ? now - *filled : 0, added = 0;
+
+	if (elapsed >= (most - *tokens) * 1000000 / rate) {
+		*tokens = most;
+		*filled = now;
+		return;
+	}
+	//Only use up the time that made whole bytes (rounded up, so calls a usec apart don't make bytes from nothing);
+	//frequent callers at a low rate would never get any otherwise
+	added = rate * elapsed / 1000000;
+	*tokens += added;
+	*filled += (added * 1000000 + rate - 1) / rate;
+}
+
+//Bytes a bucket filling at rate holds: SCHED_BURST_USEC worth, and at least a top priority round
+static uint64_t depth(uint64_t rate) {
+	uint64_t most = rate * SCHED_BURST_USEC / 1000000;
+
+	return most > SCHED_QUANTUM * SCHED_WEIGHT(MAX_PRIORITY) ? most : SCHED_QUANTUM * SCHED_WEIGHT(MAX_PRIORITY);
+}
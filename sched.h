@@ -0,0 +1,60 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "networks.h"
+
+//Most a rate limit can be (KB/s)
+#define MAX_RATE 10000000
+
+//Sessions that can be scheduled apart. Past that, the rest share the last Flow.
+#define MAX_FLOWS 256
+
+//Bytes a Flow's deficit grows by per round, times its weight
+#define SCHED_QUANTUM 1500
+
+//Longest a Token bucket fills for while nobody wants it (usec)
+#define SCHED_BURST_USEC 20000
+
+//Weight of a priority class: each one gets four times the share of the one below
+#define SCHED_WEIGHT(priority) (1U << (2 * (priority)))
+
+//Struct Declaration for a Scheduled Session.
+//demand is the bytes it last asked for, granted what it's been given towards that and not yet taken.
+//tokens holds back a Session with a rate limit of its own.
+typedef struct {
+	pid_t pid;
+	uint32_t users;
+	uint32_t weight;
+	uint64_t deficit;
+	uint64_t demand;
+	uint64_t granted;
+	uint64_t tokens;
+	uint64_t filled;
+} Flow;
+
+//Struct Declaration for the Server's Ingest Scheduler. Like the Pool, it is shared with every
+//forked Session. rate and sessionRate are bytes/sec, 0 for no limit.
+//tokens is what the whole Server may take in right now. next is the Flow whose turn it is, and turn
+//is set once that turn's quantum has been added.
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t rate;
+	uint64_t sessionRate;
+	uint64_t tokens;
+	uint64_t filled;
+	uint32_t next;
+	int32_t turn;
+	Flow flows[MAX_FLOWS];
+} Sched;
+
+//Headers for Functions in sched.c
+Sched *schedInit(uint64_t rate, uint64_t sessionRate);
+int32_t schedJoin(Sched *sched, uint32_t priority);
+void schedLeave(Sched *sched, int32_t flow);
+void schedReap(Sched *sched, pid_t pid);
+uint64_t schedTake(Sched *sched, int32_t flow, uint64_t want);
+uint64_t schedBurst(Sched *sched);
+#endif
@@ -1,64 +1,311 @@
+#include <pthread.h>
+
 #include "networks.h"
 #include "cpe464.h"
+#include "ring.h"
+#include "pool.h"
+#include "reorder.h"
+#include "sched.h"
+#include "hash.h"
+#include "chunk.h"
+#include "trace.h"
 
 /* Enum Declaration for State Differentiation */
 typedef enum State STATE;
 enum State {
-	START, FILENAME, DONE, READ_DATA, DATA_RCV
+	START, FILENAME, DONE, READ_DATA, DATA_RCV, LINGER
 };
 
+//Struct Declaration for Optional Arguments
+typedef struct {
+	int portNum;
+	char *group;
+	char *iface;
+	uint32_t ackEvery;
+	uint32_t ackDelay;
+	int32_t maxBufSize;
+	uint32_t ringDepth;
+	uint32_t poolMb;
+	uint32_t rate;
+	uint32_t sessionRate;
+	int32_t adaptiveSrej;
+	char *store;
+	char *trace;
+} Options;
+
+//Struct Declaration for Decimated/Delayed RRs.
+//repeated is set once the last RR went out a second time because rCopy went quiet (-s only).
+typedef struct {
+	uint32_t every;
+	uint32_t delay;
+	uint32_t pending;
+	uint64_t due;
+	int32_t repeated;
+} AckTimer;
+
+//Struct Declaration for SREJ Timing. Without adaptive, every packet past a hole SREJs it.
+//hole is the seqNum last SREJed, at srejTime (usec), and sinceSrej the packets that arrived past it since.
+//heard is when the last packet came in (msec).
+//repairLag and repairTime are how many packets and usec usually pass between an SREJ and its repair (scaled by 8).
+typedef struct {
+	int32_t adaptive;
+	int32_t hole;
+	uint32_t sinceSrej;
+	uint64_t srejTime;
+	uint64_t heard;
+	uint32_t repairLag;
+	uint32_t repairTime;
+} SrejTimer;
+
+//Struct Declaration for the Disk Writer Thread.
+//advertised is the last receive Window sent to rCopy.
+//hash covers everything written; digest is rCopy's, from the EOF packet.
+//verdict is the EOF ACK flag, kept to answer a resent EOF the same way.
+//chunker adds what's written to the Chunk store; NULL without one.
+//asker is where rCopy's Chunk queries come from, pinned by the first one (port 0 until then).
+//reorder is the Session's, whose share of the Pool also bounds the Window. outlet hands it our in-order data.
+//sched paces the Session as flow, NULL if not; credit is the bytes it has granted that rCopy hasn't sent yet.
+typedef struct {
+	Ring ring;
+	Chunker *chunker;
+	struct sockaddr_in asker;
+	Reorder *reorder;
+	Outlet outlet;
+	Sched *sched;
+	int32_t flow;
+	int64_t credit;
+	HashState hash;
+	uint8_t digest[HASH_LEN];
+	uint8_t verdict;
+	int32_t dataFile;
+	int32_t windowSize;
+	uint32_t advertised;
+	int32_t stop;
+	int32_t running;
+	pthread_t thread;
+} Writer;
+
+//Struct Declaration for a Multicast Receiver's Session
+typedef struct {
+	int32_t groupSk;
+	Connection peers;
+	uint32_t nakSeq;
+	uint64_t nakDue;
+	uint32_t sinceAck;
+	uint64_t ackDue;
+	uint64_t lastAck;
+	uint64_t lastHeard;
+} Group;
+
 //Function Headers 
-int processArgs (int argc, char *argv[]);
-void processServer(int serverSkNum);
-void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connection *client);
-STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *dataFile, int32_t *bufSize, int32_t *windowSize);
-STATE getData(Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize);
-void sendAck(Connection *connection, uint8_t flagType, int32_t recvSeqNum, uint32_t *seqNum);
-STATE recoverData(Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize);
-STATE checkBuffer (Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t recvSeqNum, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize);
+int processArgs (int argc, char *argv[], Options *options);
+void processServer(int serverSkNum, Options *options, Pool *pool, Sched *sched);
+void probeReply(int32_t serverSkNum, Connection *client, int32_t recvLen);
+void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connection *client, Options *options, Pool *pool,
+	Sched *sched);
+void processGroup(int32_t groupSkNum, uint8_t *buf, int32_t recvLen, Connection *client, Options *options, Pool *pool);
+STATE groupData(Group *group, Connection *client, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, STATE state);
+STATE groupPacket(Group *group, Connection *client, Connection *from, Reorder *reorder, Writer *writer, uint8_t *data_buf, int32_t data_len,
+	uint8_t flag, int32_t recvSeqNum, int32_t bufSize, int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum,
+	STATE state);
+void scheduleNak(Group *group, int32_t expectedSeqNum, uint64_t now);
+STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *dataFile, int32_t *bufSize, int32_t *windowSize,
+	int32_t *priority, int32_t maxBufSize, int32_t dedup, Pool *pool);
+void fileGood(Connection *client, int32_t bufSize, int32_t windowSize, int32_t dedup, uint8_t *packet);
+void startWriter(Writer *writer, Reorder *reorder, int32_t dataFile, int32_t bufSize, int32_t windowSize, uint32_t ringDepth,
+	char *store);
+void finishWriter(Writer *writer);
+void *writerThread(void *arg);
+void skipZeros(Writer *writer, uint64_t len);
+void copyChunk(Writer *writer, uint8_t *ref);
+int32_t deliver(void *arg, uint8_t *buf, int32_t len, uint8_t flag);
+int32_t deliverRun(void *arg, Reorder *reorder, int32_t seqNum, uint32_t count);
+void fillSlot(Writer *writer, RingSlot *slot, uint8_t *buf, int32_t len, uint8_t flag);
+uint8_t finishFile(Writer *writer);
+uint32_t advertise(Writer *writer);
+uint32_t pace(Writer *writer, uint32_t window);
+uint32_t advertiseRepair(Writer *writer);
+int32_t recvClient(uint8_t *buf, int32_t len, Connection *connection, Writer *writer, uint8_t *flag, int32_t *seqNum);
+void answerChunks(Connection *from, char *store, uint8_t *buf, int32_t len, int32_t seqNum);
+STATE getData(Connection *connection, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t *expectedSeqNum, uint32_t *serverSeqNum, AckTimer *ack, SrejTimer *srej);
+void delayAck(Connection *connection, AckTimer *ack, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum);
+STATE linger(Connection *connection, Writer *writer, int32_t bufSize, uint32_t *serverSeqNum);
+void sendAck(Connection *connection, uint8_t flagType, int32_t recvSeqNum, uint32_t rwnd, uint32_t *seqNum);
+STATE recoverData(Connection *connection, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t *expectedSeqNum, uint32_t *serverSeqNum, SrejTimer *srej);
+STATE checkBuffer (Connection *connection, Reorder *reorder, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum,
+	SrejTimer *srej);
+void srejHole(Connection *connection, SrejTimer *srej, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum);
+void srejAgain(Connection *connection, SrejTimer *srej, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum);
 
 
 int main(int argc, char *argv[]) {
 	int32_t serverSkNum = 0;
-	int portNum = 0;
+	Options options;
+	Pool *pool = NULL;
+	Sched *sched = NULL;
+
+	processArgs(argc, argv, &options); //Check arguments are valid
+	if (options.trace != NULL) {
+		//Each child session traces to its own file, options.trace.<pid>
+		traceStart(options.trace);
+	}
 
-	portNum = processArgs(argc, argv); //Check arguments are valid
+	if (options.store != NULL && mkdir(options.store, 0777) < 0 && errno != EEXIST) {
+		perror("Chunk store");
+		exit(-1);
+	}
 
 	/*Initialize the Error functions */
 	sendtoErr_init(atof(argv[1]), DROP_ON, FLIP_ON, DEBUG_ON, RSEED_ON);
 
-	serverSkNum = udpSetup(portNum);
+	if (options.group != NULL) {
+		//Receive from a Multicast group instead of a plain port
+		serverSkNum = mcastSetup(options.group, options.portNum, options.iface);
+	}
+	else {
+		serverSkNum = udpSetup(options.portNum);
+	}
+
+	//Every Session's held packets come out of one budget, so the Pool is made before any are forked
+	pool = poolInit((uint64_t) options.poolMb << 20);
+	if (options.rate > 0 || options.sessionRate > 0) {
+		//Without a limit there's nothing to share out, and Sessions go unpaced
+		sched = schedInit((uint64_t) options.rate * 1024, (uint64_t) options.sessionRate * 1024);
+	}
 
-	processServer(serverSkNum);
+	processServer(serverSkNum, &options, pool, sched);
 
 	return 0;
 }
 
 //Check Arguments for Validity
-int processArgs (int argc, char *argv[]) {
-	int portNumber = 0;
-	if (argc < 2 || argc > 3) {
-		printf("Usage: %s error_rate <Port Number>\n", argv[0]);
+int processArgs (int argc, char *argv[], Options *options) {
+	int index = 2;
+
+	options->portNum = 0;
+	options->group = NULL;
+	options->iface = NULL;
+	options->ackEvery = DEFAULT_ACK_EVERY;
+	options->ackDelay = DEFAULT_ACK_DELAY;
+	options->maxBufSize = MAX_BUF_LEN;
+	options->ringDepth = DEFAULT_RING_DEPTH;
+	options->poolMb = DEFAULT_POOL_MB;
+	options->rate = 0;
+	options->sessionRate = 0;
+	options->adaptiveSrej = 0;
+	options->store = NULL;
+	options->trace = NULL;
+
+	if (argc < 2) {
+		printf("Usage: %s error_rate <Port Number> [-m group] [-i interface] [-a ackEvery] [-d ackDelay(ms)] [-b maxBufSize] [-r ringDepth] [-M poolBudget(MB)] [-R rate(KB/s)] [-L sessionRate(KB/s)] [-s] [-c chunkStore] [-t traceFile]\n", argv[0]);
 		exit(-1);
 	}
 	if (atof(argv[1]) < MIN_ERR || atof(argv[1]) > MAX_ERR) {
 		printf("Invalid error Rate. (Must be between 0 and 1) Input Error: %f\n", atof(argv[1]));
 		exit(-1);
 	}
-	if (argc == 3) {
-		portNumber = atoi(argv[2]);
+	while (index < argc) {
+		if (strcmp(argv[index], "-m") == 0 && index + 1 < argc) {
+			options->group = argv[++index];
+		}
+		else if (strcmp(argv[index], "-i") == 0 && index + 1 < argc) {
+			options->iface = argv[++index];
+		}
+		else if (strcmp(argv[index], "-a") == 0 && index + 1 < argc) {
+			if (atoi(argv[++index]) < 1) {
+				printf("Invalid ACK interval. (Must be at least 1)\n");
+				exit(-1);
+			}
+			options->ackEvery = atoi(argv[index]);
+		}
+		else if (strcmp(argv[index], "-d") == 0 && index + 1 < argc) {
+			if (atoi(argv[++index]) < 0 || atoi(argv[index]) > MAX_ACK_DELAY) {
+				printf("Invalid ACK delay. (Must be between 0 and %d ms)\n", MAX_ACK_DELAY);
+				exit(-1);
+			}
+			options->ackDelay = atoi(argv[index]);
+		}
+		else if (strcmp(argv[index], "-b") == 0 && index + 1 < argc) {
+			//Largest payload a client may negotiate
+			options->maxBufSize = atoi(argv[++index]);
+			if (options->maxBufSize < MIN_BUF_LEN || options->maxBufSize > MAX_BUF_LEN) {
+				printf("Invalid buffer. (Must be between %d and %d) Input Buffer: %s\n", MIN_BUF_LEN, MAX_BUF_LEN, argv[index]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-r") == 0 && index + 1 < argc) {
+			//Packets the disk may fall behind by before the Window closes
+			options->ringDepth = atoi(argv[++index]);
+			if (options->ringDepth < 1 || options->ringDepth > MAX_RING_DEPTH) {
+				printf("Invalid ring depth. (Must be between 1 and %d) Input Depth: %s\n", MAX_RING_DEPTH, argv[index]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-M") == 0 && index + 1 < argc) {
+			//Memory for packets held past a hole, across every Session. Windows shrink to fit it.
+			options->poolMb = atoi(argv[++index]);
+			if (options->poolMb < 1 || options->poolMb > MAX_POOL_MB) {
+				printf("Invalid pool budget. (Must be between 1 and %d MB) Input Budget: %s\n", MAX_POOL_MB, argv[index]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-R") == 0 && index + 1 < argc) {
+			//Most every Session together may take in. Shared out by priority.
+			if (atoi(argv[++index]) < 1 || atoi(argv[index]) > MAX_RATE) {
+				printf("Invalid rate. (Must be between 1 and %d KB/s) Input Rate: %s\n", MAX_RATE, argv[index]);
+				exit(-1);
+			}
+			options->rate = atoi(argv[index]);
+		}
+		else if (strcmp(argv[index], "-L") == 0 && index + 1 < argc) {
+			//Most any one Session may take in
+			if (atoi(argv[++index]) < 1 || atoi(argv[index]) > MAX_RATE) {
+				printf("Invalid session rate. (Must be between 1 and %d KB/s) Input Rate: %s\n", MAX_RATE, argv[index]);
+				exit(-1);
+			}
+			options->sessionRate = atoi(argv[index]);
+		}
+		else if (strcmp(argv[index], "-s") == 0) {
+			//SREJ each hole once, learning how long repairs take, instead of once per packet past it
+			options->adaptiveSrej = 1;
+		}
+		else if (strcmp(argv[index], "-c") == 0 && index + 1 < argc) {
+			//Directory of Chunks kept from earlier files, so rCopy can skip sending them again
+			options->store = argv[++index];
+			if (strlen(options->store) >= MAX_LEN) {
+				printf("Chunk store path too long. (Must be under %d)\n", MAX_LEN);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[index], "-t") == 0 && index + 1 < argc) {
+			//Binary packet trace for tracedump
+			options->trace = argv[++index];
+		}
+		else if (argv[index][0] != '-') {
+			options->portNum = atoi(argv[index]);
+		}
+		else {
+			printf("Unknown option: %s\n", argv[index]);
+			exit(-1);
+		}
+		index++;
+	}
+	if (options->group != NULL && options->portNum == 0) {
+		printf("A Port Number is required to join a multicast group.\n");
+		exit(-1);
 	}
-	return portNumber;
+	return options->portNum;
 }
 
 //Run the Server
-void processServer(int serverSkNum) {
+void processServer(int serverSkNum, Options *options, Pool *pool, Sched *sched) {
 	pid_t pid = 0;
 	int status = 0;
-	uint8_t buf[MAX_LEN];
+	//Big enough for a path MTU probe of the largest payload
+	uint8_t *buf = malloc(MAX_BUF_LEN + HEADER_LEN);
 	Connection client;
 	uint8_t flag = 0;
 	int32_t seqNum = 0, recvLen = 0;
@@ -66,33 +313,66 @@ void processServer(int serverSkNum) {
 	while (1) { //Loop until force closed
 		if (selectCall(serverSkNum, SHORT_TIME, 0, NOT_NULL) == 1) {
 			//Someone is connecting
-			recvLen = recv_buf(buf, MAX_LEN, serverSkNum, &client, &flag, &seqNum);
-			if (recvLen != CRC_ERROR) {
+			recvLen = recv_buf(buf, MAX_BUF_LEN + HEADER_LEN, serverSkNum, &client, &flag, &seqNum);
+			if (recvLen != CRC_ERROR && flag == PROBE_FLAG) {
+				//Probes are answered straight off the main socket; no session needed
+				probeReply(serverSkNum, &client, recvLen);
+			}
+			else if (recvLen != CRC_ERROR && options->group != NULL) {
+				//Group traffic all lands on this one socket, so no fork.
+				//Anything but a new file is left over from an old session.
+				if (flag == REMOTE_FN_FLAG) {
+					processGroup(serverSkNum, buf, recvLen, &client, options, pool);
+				}
+			}
+			else if (recvLen != CRC_ERROR && flag == REMOTE_FN_FLAG) {
+				//Anything else is left over from an old session
 				if ((pid = fork()) < 0) {
 					perror("fork");
 					exit(-1);
 				}
 				if (pid == 0) {
 					//New Client. Process.
-					processClient(serverSkNum, buf, recvLen, &client);
+					traceFork();
+					processClient(serverSkNum, buf, recvLen, &client, options, pool, sched);
 					exit(0);
 				}
 			}
-			while (waitpid(-1, &status, WNOHANG) > 0) {}
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				if (sched != NULL) {
+					//In case it died without giving up its Flow
+					schedReap(sched, pid);
+				}
+				//Or its Pool buffers
+				poolReap(pool, pid);
+			}
 		}
 	}
 }
 
+//Path MTU probe from rCopy. Tell it how much arrived.
+void probeReply(int32_t serverSkNum, Connection *client, int32_t recvLen) {
+	uint8_t packet[MAX_LEN];
+	uint32_t size = htonl(recvLen);
+
+	client->sk_num = serverSkNum;
+	send_buf((uint8_t *) &size, sizeof(uint32_t), client, PROBE_FLAG, 0, packet);
+}
+
 //Process the Client
-void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connection *client) {
-	STATE state = START;
+void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connection *client, Options *options, Pool *pool,
+	Sched *sched) {
+	STATE state = START, lastState = START;
 	int32_t dataFile = 0;
 	int32_t bufSize = 0;
 	int32_t windowSize = 0;
-	uint32_t bufferedData = 0;
+	int32_t priority = PRIORITY_NORMAL;
 	int32_t seqNum = START_SEQ_NUM;
 	uint32_t serverSeqNum = 1;
-	Window *winBuf;
+	Reorder reorder;
+	AckTimer ack;
+	SrejTimer srej;
+	Writer writer;
 
 	//Loops until Client is Done, or disappears. 
 	while (state != DONE) {
@@ -104,16 +384,43 @@ void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connectio
 			case FILENAME:
 				//Get the filename info from client, open and prep for writing
 				//Initialize the buffer to store unexpected packets
-				state = fileName(client, buf, recvLen, &dataFile, &bufSize, &windowSize);
-				winBuf = calloc(windowSize, sizeof(Window));
+				state = fileName(client, buf, recvLen, &dataFile, &bufSize, &windowSize, &priority, options->maxBufSize,
+					options->store != NULL, pool);
+				//Never hold back more than a quarter Window, or rCopy's Window closes first
+				ack.every = options->ackEvery < windowSize / 4 ? options->ackEvery : windowSize / 4;
+				ack.every = ack.every > 0 ? ack.every : 1;
+				ack.delay = options->ackDelay;
+				ack.pending = 0;
+				ack.repeated = 0;
+				srej.adaptive = options->adaptiveSrej;
+				srej.hole = -1;
+				srej.sinceSrej = 0;
+				srej.srejTime = 0;
+				srej.heard = 0;
+				srej.repairLag = 8 * SREJ_SLACK;
+				srej.repairTime = 8 * SREJ_SLACK_USEC;
+				writer.running = 0;
+				writer.sched = NULL;
+				reorder.slots = NULL;
+				if (state == READ_DATA) {
+					reorderInit(&reorder, pool, windowSize, bufSize);
+					//Disk writes happen off to the side; the Window tracks how far behind they are
+					startWriter(&writer, &reorder, dataFile, bufSize, windowSize, options->ringDepth, options->store);
+					writer.sched = sched;
+					writer.flow = sched != NULL ? schedJoin(sched, priority) : 0;
+				}
 				break;
 			case READ_DATA:
 				//Receive data from Client and process it
-				state = getData(client, winBuf, dataFile, bufSize, windowSize, &seqNum, &serverSeqNum, &bufferedData);
+				state = getData(client, &reorder, &writer, bufSize, &seqNum, &serverSeqNum, &ack, &srej);
 				break;
 			case DATA_RCV:
 				//Data was lost. Recover it.
-				state = recoverData(client, winBuf, dataFile, bufSize, windowSize, &seqNum, &serverSeqNum, &bufferedData);
+				state = recoverData(client, &reorder, &writer, bufSize, &seqNum, &serverSeqNum, &srej);
+				break;
+			case LINGER:
+				//File is complete. Answer any resent EOF until rCopy goes quiet.
+				state = linger(client, &writer, bufSize, &serverSeqNum);
 				break;
 			case DONE: 
 				//Client is done. 
@@ -124,18 +431,48 @@ void processClient(int32_t serverSkNum, uint8_t *buf, int32_t recvLen, Connectio
 				state = DONE;
 				break;
 		}
+		if (state != lastState) {
+			traceEvent(TRACE_STATE, state, 0, 0, lastState);
+			lastState = state;
+		}
 	}
-
+	if (writer.sched != NULL) {
+		schedLeave(writer.sched, writer.flow);
+	}
+	finishWriter(&writer);
+	reorderFree(&reorder);
 }
 
 //Gets filename info from Client, Opens/Creates file w/ proper permissions
-STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *dataFile, int32_t *bufSize,int32_t *windowSize) {
+//A newer rCopy follows the filename's terminator with its priority class.
+STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *dataFile, int32_t *bufSize,int32_t *windowSize,
+	int32_t *priority, int32_t maxBufSize, int32_t dedup, Pool *pool) {
 	uint8_t response[1];
 	char filename[MAX_LEN];
 	STATE returnValue = DONE;
 	memcpy(bufSize, buf, SIZE_OF_BUF_SIZE);
+	*bufSize = ntohl(*bufSize);
 	memcpy(windowSize, buf + 4, 4);
-	memcpy(filename, &buf[8], recvLen -8);
+	*windowSize = ntohl(*windowSize);
+	recvLen = recvLen - 8 < MAX_LEN ? recvLen - 8 : MAX_LEN - 1;
+	memcpy(filename, &buf[8], recvLen);
+	filename[recvLen] = '\0';
+	if (strlen(filename) + 1 < recvLen) {
+		*priority = (uint8_t) filename[strlen(filename) + 1];
+		*priority = *priority <= MAX_PRIORITY ? *priority : MAX_PRIORITY;
+	}
+
+	//Client gets what it asked for, up to our own limit. FN_GOOD tells it which.
+	if (*bufSize <= 0 || *bufSize > maxBufSize) {
+		*bufSize = maxBufSize;
+	}
+	//Likewise the Window, up to what the Pool could ever hold
+	if (*windowSize > MAX_WINDOW) {
+		*windowSize = MAX_WINDOW;
+	}
+	if (*windowSize > 0) {
+		*windowSize = reorderFit(pool, *windowSize, *bufSize);
+	}
 
 	/*Create client socket to allow for processing this particular client */
 	if ((client->sk_num = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -143,14 +480,20 @@ STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *data
 		exit(-1);
 	}
 
-	if (((*dataFile) = open(filename, O_CREAT | O_TRUNC |O_WRONLY, 0666)) < 0) {
+	if (*windowSize <= 0) {
+		//No Window to send in
+		send_buf(response, 0, client, FN_BAD, 0, buf);
+		returnValue = DONE;
+	}
+	else if (((*dataFile) = open(filename, O_CREAT | O_TRUNC |O_WRONLY, 0666)) < 0) {
 		//File unable to be opened/created. BAD_FILE returned.
 		send_buf(response, 0, client, FN_BAD, 0, buf);
 		returnValue = DONE;
 	}
 	else {
 		//File successfullly opened/created. GOOD_FILE returned.
-		send_buf(response, 0, client, FN_GOOD, 0, buf);
+		sizeSocket(client->sk_num, (int64_t) *windowSize * (*bufSize + HEADER_LEN));
+		fileGood(client, *bufSize, *windowSize, dedup, buf);
 		returnValue = READ_DATA;
 	}
 
@@ -158,65 +501,434 @@ STATE fileName (Connection *client, uint8_t *buf, int32_t recvLen, int32_t *data
 
 }
 
+//FN_GOOD carries the payload size and Window the server accepted, and whether rCopy may ask about Chunks
+void fileGood(Connection *client, int32_t bufSize, int32_t windowSize, int32_t dedup, uint8_t *packet) {
+	uint8_t good[FN_GOOD_LEN];
+	uint32_t accepted = htonl(bufSize);
+
+	memcpy(good, &accepted, SIZE_OF_BUF_SIZE);
+	good[SIZE_OF_BUF_SIZE] = dedup ? 1 : 0;
+	accepted = htonl(windowSize);
+	memcpy(good + SIZE_OF_BUF_SIZE + 1, &accepted, SIZE_OF_BUF_SIZE);
+	send_buf(good, FN_GOOD_LEN, client, FN_GOOD, 0, packet);
+}
+
+//Start the Disk Thread draining the Ring into the file
+void startWriter(Writer *writer, Reorder *reorder, int32_t dataFile, int32_t bufSize, int32_t windowSize, uint32_t ringDepth,
+	char *store) {
+	writer->reorder = reorder;
+	writer->outlet.one = deliver;
+	writer->outlet.run = deliverRun;
+	writer->outlet.arg = writer;
+	memset(&writer->asker, 0, sizeof(writer->asker));
+	writer->sched = NULL;
+	writer->flow = 0;
+	writer->credit = 0;
+	writer->dataFile = dataFile;
+	writer->windowSize = windowSize;
+	writer->stop = 0;
+	writer->advertised = windowSize;
+	writer->verdict = END_OF_FILE;
+	hashInit(&writer->hash);
+	writer->chunker = NULL;
+
+	if (store != NULL && (writer->chunker = malloc(sizeof(Chunker))) == NULL) {
+		perror("startWriter, malloc");
+		exit(-1);
+	}
+	if (store != NULL) {
+		chunkerInit(writer->chunker, store);
+	}
+	//Deep enough for the whole Window, or advertise() could never offer all of it
+	if (ringInit(&writer->ring, ringDepth > (uint32_t) windowSize ? ringDepth : (uint32_t) windowSize, bufSize) < 0) {
+		perror("startWriter, ringInit");
+		exit(-1);
+	}
+	if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+		perror("startWriter, pthread_create");
+		exit(-1);
+	}
+	writer->running = 1;
+}
+
+//Wait for the whole file to reach disk, then check it hashed the same as rCopy's.
+//Returns the flag to ACK the EOF with.
+uint8_t finishFile(Writer *writer) {
+	uint8_t digest[HASH_LEN];
+
+	finishWriter(writer);
+	hashDigest(&writer->hash, digest);
+	if (writer->verdict == END_OF_FILE && memcmp(digest, writer->digest, HASH_LEN) != 0) {
+		writer->verdict = EOF_BAD;
+	}
+	if (writer->verdict == EOF_BAD) {
+		printf("File hash mismatch. The received file is corrupt.\n");
+	}
+	return writer->verdict;
+}
+
+//Wait for everything handed over so far to reach the file
+void finishWriter(Writer *writer) {
+	if (writer->running) {
+		__atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(writer->thread, NULL);
+		ringFree(&writer->ring);
+		free(writer->chunker);
+		writer->chunker = NULL;
+		writer->running = 0;
+	}
+}
+
+//Disk Thread. Writes in-order data a buffer at a time until told to stop and the Ring is empty.
+void *writerThread(void *arg) {
+	Writer *writer = arg;
+	RingSlot *slot = NULL;
+	off_t end = 0;
+
+	while (1) {
+		if ((slot = ringConsume(&writer->ring)) == NULL) {
+			if (__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE) && ringCount(&writer->ring) == 0) {
+				break;
+			}
+			ringWait();
+			continue;
+		}
+		if (slot->flag == HOLE_FLAG) {
+			skipZeros(writer, getHoleLen(slot->buf));
+		}
+		else if (slot->flag == CHUNK_REF_FLAG) {
+			copyChunk(writer, slot->buf);
+		}
+		else {
+			if (write(writer->dataFile, slot->buf, slot->buf_len) != slot->buf_len) {
+				perror("write Error");
+				exit(-1);
+			}
+			hashUpdate(&writer->hash, slot->buf, slot->buf_len);
+			if (writer->chunker != NULL) {
+				chunkerFeed(writer->chunker, slot->buf, slot->buf_len);
+			}
+		}
+		ringRelease(&writer->ring);
+	}
+	if (writer->chunker != NULL) {
+		chunkerFlush(writer->chunker);
+	}
+	if ((end = lseek(writer->dataFile, 0, SEEK_CUR)) > 0 && ftruncate(writer->dataFile, end) < 0) {
+		//A hole at the very end only moved the offset. Make the file that long.
+		perror("writerThread, ftruncate");
+		exit(-1);
+	}
+	return NULL;
+}
+
+//Leave a hole instead of writing zeros. Something we can't seek on gets the zeros written.
+void skipZeros(Writer *writer, uint64_t len) {
+	static const uint8_t zeros[4096];
+	uint32_t chunk = 0;
+
+	if (writer->chunker != NULL) {
+		chunkerFlush(writer->chunker);
+	}
+	hashZeros(&writer->hash, len);
+	if (lseek(writer->dataFile, len, SEEK_CUR) >= 0) {
+		return;
+	}
+	while (len > 0) {
+		chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+		if (write(writer->dataFile, zeros, chunk) != chunk) {
+			perror("write Error");
+			exit(-1);
+		}
+		len -= chunk;
+	}
+}
+
+//rCopy found this Chunk in our store. Copy it from there; data resumes on a new Chunk after it.
+//A Chunk gone missing or damaged since rCopy asked leaves the file short. The EOF is answered with
+//EOF_BAD however the hash comes out, and rCopy sends the file again without the store.
+void copyChunk(Writer *writer, uint8_t *ref) {
+	uint32_t len = 0;
+
+	if (writer->chunker == NULL) {
+		//We never offered a store
+		return;
+	}
+	chunkerFlush(writer->chunker);
+	memcpy(&len, ref + CHUNK_ID_LEN, sizeof(uint32_t));
+	len = ntohl(len);
+	if (len > sizeof(writer->chunker->buf) || chunkCopy(writer->chunker->store, ref, writer->chunker->buf, len, writer->dataFile) < 0) {
+		printf("Chunk missing from the store.\n");
+		writer->verdict = EOF_BAD;
+		return;
+	}
+	//The flush left the Chunker's buffer free to hash from
+	hashUpdate(&writer->hash, writer->chunker->buf, len);
+}
+
+//Hand in-order data to the Disk Thread. Only waits if rCopy ignored our Window.
+//Returns 1 if it was the EOF.
+int32_t deliver(void *arg, uint8_t *buf, int32_t len, uint8_t flag) {
+	Writer *writer = arg;
+	RingSlot *slot = NULL;
+
+	while ((slot = ringProduce(&writer->ring)) == NULL) {
+		ringWait();
+	}
+	fillSlot(writer, slot, buf, len, flag);
+	ringPublish(&writer->ring);
+	return flag == END_OF_FILE;
+}
+
+//Hand the Disk Thread a run of held packets, as many at once as the Ring has room for.
+//Returns 1 if the run ended with the EOF.
+int32_t deliverRun(void *arg, Reorder *reorder, int32_t seqNum, uint32_t count) {
+	Writer *writer = arg;
+	Held *held = NULL;
+	uint32_t room = 0, index = 0;
+	int32_t eof = 0;
+
+	while (count > 0) {
+		while ((room = ringRoom(&writer->ring)) == 0) {
+			ringWait();
+		}
+		room = room < count ? room : count;
+		for (index = 0; index < room; index++) {
+			held = reorderSlot(reorder, seqNum + index);
+			fillSlot(writer, ringProduceAt(&writer->ring, index), held->buf, held->len, held->flag);
+			eof = (held->flag == END_OF_FILE);
+		}
+		ringPublishRun(&writer->ring, room);
+		reorderRelease(reorder, seqNum, room);
+		seqNum += room;
+		count -= room;
+	}
+	return eof;
+}
+
+//Copy a packet into a Ring slot. The EOF packet ends with rCopy's Digest, which is kept instead of written.
+//What arrives is charged against the Scheduler's credit.
+void fillSlot(Writer *writer, RingSlot *slot, uint8_t *buf, int32_t len, uint8_t flag) {
+	writer->credit -= len;
+	if (flag == END_OF_FILE && len < HASH_LEN) {
+		//No Digest to check against
+		writer->verdict = EOF_BAD;
+	}
+	else if (flag == END_OF_FILE) {
+		len -= HASH_LEN;
+		memcpy(writer->digest, buf + len, HASH_LEN);
+	}
+	memcpy(slot->buf, buf, len);
+	slot->buf_len = len;
+	slot->flag = flag;
+}
+
+//Receive Window to advertise: packets past the last ACK we have room for.
+//Every one of them has a Window slot to wait in, and must fit in the Ring once it's in order.
+//All but the first may arrive past a hole, so there must be Pool buffers to hold them too.
+uint32_t advertise(Writer *writer) {
+	uint32_t most = writer->ring.depth < (uint32_t) writer->windowSize ? writer->ring.depth : (uint32_t) writer->windowSize;
+	uint32_t room = writer->ring.depth - ringCount(&writer->ring);
+	uint32_t window = room < most ? room : most, held = 0;
+
+	if (writer->advertised == 0 && window < (most / 4 > 0 ? most / 4 : 1)) {
+		//Don't reopen a closed Window a sliver at a time
+		window = 0;
+	}
+	if (window > 1 && (held = reorderRoom(writer->reorder) + 1) < window) {
+		//Pool is tight. Shrink the Window instead of dropping what we couldn't hold; the first packet needs no buffer.
+		window = held;
+	}
+	if (writer->sched != NULL) {
+		window = pace(writer, window);
+	}
+	writer->advertised = window;
+	return window;
+}
+
+//A paced Session only offers what the Scheduler granted, asking for enough to fill the Window.
+//Short of a quarter Window's worth, the Window shuts until more comes in; that and holding back
+//the RRs is what slows rCopy down. Offering a packet or two at a time would be smoother, but the
+//last packet of every burst can only be recovered by rCopy's timer if it's lost.
+//Credit never builds past the Window or what the Scheduler could grant in one go (but always a packet),
+//and the Window reopens at no more than that, or a big Window behind a slow bucket would never reopen.
+uint32_t pace(Writer *writer, uint32_t window) {
+	uint64_t bufSize = writer->ring.bufSize, burst = schedBurst(writer->sched);
+	uint64_t most = (uint64_t) window * bufSize, reopen = (window / 4 > 0 ? window / 4 : 1) * bufSize;
+	int64_t want = 0;
+
+	burst = burst > bufSize ? burst : bufSize;
+	most = most < burst ? most : burst;
+	reopen = reopen < burst ? reopen : burst;
+	if ((want = (int64_t) most - writer->credit) > 0) {
+		writer->credit += schedTake(writer->sched, writer->flow, want);
+	}
+	if (writer->credit > (int64_t) most) {
+		//The Window shrank since; what it can no longer use goes unused
+		writer->credit = most;
+	}
+	if (writer->credit < (int64_t) reopen) {
+		return 0;
+	}
+	return writer->credit / bufSize < window ? writer->credit / bufSize : window;
+}
+
+//An SREJ always lets the missing packet through, even with the Ring full.
+//deliver() waits for room, and the gap has to close before the Window can.
+uint32_t advertiseRepair(Writer *writer) {
+	uint32_t window = advertise(writer);
+	return window > 0 ? window : 1;
+}
+
+//Receive on the Client's session socket. rCopy's Disk Thread asks about Chunks from a socket of its own;
+//those are answered here. They, and anything else not from the Client, come back as CRC_ERROR.
+//Queries are only answered from the Client's host, and from the one port it first asked from,
+//so nobody else can find out what the store holds.
+int32_t recvClient(uint8_t *buf, int32_t len, Connection *connection, Writer *writer, uint8_t *flag, int32_t *seqNum) {
+	Connection from;
+	int32_t recvLen = recv_buf(buf, len, connection->sk_num, &from, flag, seqNum);
+
+	if (recvLen == CRC_ERROR) {
+		return CRC_ERROR;
+	}
+	if (*flag == CHUNK_QUERY_FLAG && writer->chunker != NULL) {
+		if (from.remote.sin_addr.s_addr != connection->remote.sin_addr.s_addr ||
+			(writer->asker.sin_port != 0 && !sameAddr(&from.remote, &writer->asker))) {
+			return CRC_ERROR;
+		}
+		writer->asker = from.remote;
+		from.sk_num = connection->sk_num;
+		answerChunks(&from, writer->chunker->store, buf, recvLen, *seqNum);
+		return CRC_ERROR;
+	}
+	if (!sameAddr(&from.remote, &connection->remote)) {
+		return CRC_ERROR;
+	}
+	return recvLen;
+}
+
+//CHUNK_QUERY payload: a count (network order), then that many IDs.
+//CHUNK_HAVE answers with the same seq, a bit set for each one in the store.
+void answerChunks(Connection *from, char *store, uint8_t *buf, int32_t len, int32_t seqNum) {
+	uint8_t have[CHUNK_BITMAP_LEN], packet[MAX_LEN];
+	uint32_t count = 0, index = 0;
+
+	if (len < sizeof(uint32_t)) {
+		return;
+	}
+	memcpy(&count, buf, sizeof(uint32_t));
+	count = ntohl(count);
+	if (count > CHUNK_BATCH || sizeof(uint32_t) + count * CHUNK_ID_LEN > len) {
+		return;
+	}
+	memset(have, 0, sizeof(have));
+	for (index = 0; index < count; index++) {
+		if (chunkHave(store, buf + sizeof(uint32_t) + index * CHUNK_ID_LEN)) {
+			have[index / 8] |= 1 << (index % 8);
+		}
+	}
+	send_buf(have, sizeof(have), from, CHUNK_HAVE_FLAG, seqNum, packet);
+}
+
 //Receive data from Client and process 
-STATE getData(Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize) {
+STATE getData(Connection *connection, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t *expectedSeqNum, uint32_t *serverSeqNum, AckTimer *ack, SrejTimer *srej) {
 	int32_t recvSeqNum = 0, data_len = 0;
-   uint8_t flag = 0, data_buf[MAX_LEN];
-   int32_t index = 0;
+   uint8_t flag = 0, data_buf[bufSize + HEADER_LEN];
+   int64_t wait = 0;
    
+   if (ack->pending > 0) {
+   	//RR held back. Only wait as long as its delay allows.
+   	wait = (int64_t) ack->due - (int64_t) timeNowMs();
+   	wait = wait > 0 ? wait : 0;
+   	if (!selectCall(connection->sk_num, wait / 1000, (wait % 1000) * 1000, 1)) {
+   		sendAck(connection, RR_FLAG, *expectedSeqNum - 1, advertise(writer), serverSeqNum);
+   		ack->pending = 0;
+   		return READ_DATA;
+   	}
+   }
+   else if (writer->advertised == 0) {
+   	//rCopy was told to stop. Tell it to go again as soon as the disk catches up.
+   	if (!selectCall(connection->sk_num, 0, RING_WAIT_USEC, 1)) {
+   		if (advertise(writer) > 0) {
+   			sendAck(connection, RR_FLAG, *expectedSeqNum - 1, writer->advertised, serverSeqNum);
+   		}
+   		return READ_DATA;
+   	}
+   }
+   else if (srej->adaptive && !ack->repeated && *expectedSeqNum > START_SEQ_NUM && !selectCall(connection->sk_num,
+   	(srej->repairTime / 4 + SREJ_SLACK_USEC) / 1000000, (srej->repairTime / 4 + SREJ_SLACK_USEC) % 1000000, 1)) {
+   	//rCopy went quiet. If our last RR was lost with its Window full, it waits out its timer; send it once more.
+   	//Not before any data: rCopy may still be waiting on an FN_GOOD, and would take the RR for one.
+   	sendAck(connection, RR_FLAG, *expectedSeqNum - 1, advertise(writer), serverSeqNum);
+   	ack->repeated = 1;
+   	return READ_DATA;
+   }
    /* If server receives nothing for 10 seconds close connection */
-   if (!selectCall(connection->sk_num, LONG_TIME, 0, 1)){
+   else if (!selectCall(connection->sk_num, LONG_TIME, 0, 1)){
       return DONE;
    }
+   ack->repeated = 0;
    
 
-   data_len = recv_buf(data_buf, bufSize + 8, connection->sk_num, connection, &flag, &recvSeqNum);
+   data_len = recvClient(data_buf, bufSize + HEADER_LEN, connection, writer, &flag, &recvSeqNum);
    if (data_len == CRC_ERROR) {
    	//Bits fliped
       return READ_DATA;
    }
-   if (recvSeqNum == *expectedSeqNum) {
-   	//Data was what was expected. Write to file. 
-   	write(dataFile, &data_buf, data_len);
-   	
-      
-		(*expectedSeqNum)++;
-   }
-   else if (recvSeqNum > *expectedSeqNum) {
-   	//Unexpected Data. Store in Buffer and send SREJ. Enter Data Recovery
-   	index = recvSeqNum % windowSize;
-   	memcpy(winBuf[index].buf, data_buf, data_len);
-   	winBuf[index].seqNum = recvSeqNum;
-   	winBuf[index].buf_len = data_len;
-   	winBuf[index].flag = flag;
-   	(*bufferedDataSize)++;
-
-   	sendAck(connection, SREJ_FLAG, *expectedSeqNum, serverSeqNum);
-   	return DATA_RCV;
-   }
-   else {
-   	//Send RR.
-   	sendAck(connection, RR_FLAG, recvSeqNum, serverSeqNum);
+   if (flag == WIN_PROBE_FLAG) {
+   	//rCopy's Window is shut and it's asking whether ours reopened
+   	sendAck(connection, RR_FLAG, *expectedSeqNum - 1, advertise(writer), serverSeqNum);
+   	ack->pending = 0;
    	return READ_DATA;
    }
-
-	if (flag == DATA_FLAG) {
-		sendAck(connection, RR_FLAG, recvSeqNum, serverSeqNum);
-		(*expectedSeqNum)++;
-   }
-   else if (flag == END_OF_FILE) {
-   	//Send EOF acknowledgement. Close connection after.
-      sendAck(connection, END_OF_FILE, recvSeqNum, serverSeqNum);
-      return DONE;
+   switch (reorderArrive(reorder, &writer->outlet, expectedSeqNum, recvSeqNum, data_buf, data_len, flag)) {
+   	case ARRIVED_EOF:
+   		//ACK the EOF once it is all on disk and hashed. Linger in case it is lost.
+   		sendAck(connection, finishFile(writer), *expectedSeqNum - 1, 0, serverSeqNum);
+   		return LINGER;
+   	case ARRIVED_NEXT:
+   		//Data was what was expected, and is on its way to the file
+   		delayAck(connection, ack, writer, *expectedSeqNum, serverSeqNum);
+   		return READ_DATA;
+   	case ARRIVED_HELD:
+   		//Unexpected Data, now in the Buffer. Send SREJ and enter Data Recovery.
+   		//The SREJ acknowledges everything before it too; nothing left held back
+   		srejHole(connection, srej, writer, *expectedSeqNum, serverSeqNum);
+   		ack->pending = 0;
+   		return DATA_RCV;
+   	case ARRIVED_DROPPED:
+   		//Past our Window, or no Pool buffer to hold it; rCopy will send it again
+   		return READ_DATA;
+   	default:
+   		//Duplicate. Our RR may have been lost; re-send the cumulative RR now.
+   		sendAck(connection, RR_FLAG, *expectedSeqNum - 1, advertise(writer), serverSeqNum);
+   		ack->pending = 0;
+   		return READ_DATA;
    }
-   return READ_DATA;
+}
+
+//Count an in-order packet. RR once every ack->every of them, or once the first one's delay is up.
+//A small advertised Window is half used up sooner; don't leave rCopy waiting on it.
+void delayAck(Connection *connection, AckTimer *ack, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum) {
+	ack->pending++;
+	if (ack->pending >= ack->every || ack->pending >= writer->advertised / 2) {
+		sendAck(connection, RR_FLAG, expectedSeqNum - 1, advertise(writer), serverSeqNum);
+		ack->pending = 0;
+	}
+	else if (ack->pending == 1) {
+		ack->due = timeNowMs() + ack->delay;
+	}
 }
 
 //Sends ACK packets to client
-void sendAck(Connection *connection, uint8_t flagType, int32_t recvSeqNum, uint32_t *seqNum) {
+//RR/SREJ payload: ACK number (host order), then the receive Window (network order)
+void sendAck(Connection *connection, uint8_t flagType, int32_t recvSeqNum, uint32_t rwnd, uint32_t *seqNum) {
 	uint8_t data[MAX_LEN], packet[MAX_LEN];
-	if (flagType == RR_FLAG || flagType == END_OF_FILE) {
+	if (flagType == SREJ_FLAG) {
+		traceEvent(TRACE_SREJ, recvSeqNum, flagType, 0, rwnd);
+	}
+	if (flagType == RR_FLAG || flagType == END_OF_FILE || flagType == EOF_BAD) {
 		recvSeqNum++;
 	}
 	*seqNum = recvSeqNum;
@@ -225,92 +937,315 @@ void sendAck(Connection *connection, uint8_t flagType, int32_t recvSeqNum, uint3
 	}
 	//Set sequence number information into buf
 	memcpy(&data[0], &recvSeqNum, 4);
+	rwnd = htonl(rwnd);
+	memcpy(&data[4], &rwnd, 4);
 
 	//Send it on its merry way.
-	send_buf(data, sizeof(int32_t), connection, flagType, *seqNum, packet);
+	send_buf(data, 2 * sizeof(int32_t), connection, flagType, *seqNum, packet);
 	
 }
 
+//EOF was ACKed. rCopy resends its EOF if that ACK was lost, so ACK it again.
+STATE linger(Connection *connection, Writer *writer, int32_t bufSize, uint32_t *serverSeqNum) {
+	int32_t recvSeqNum = 0;
+	uint8_t data_buf[bufSize + HEADER_LEN];
+	uint8_t flag = 0;
+
+	if (!selectCall(connection->sk_num, LINGER_TIME / 1000, 0, 1)) {
+		return DONE;
+	}
+	if (recvClient(data_buf, bufSize + HEADER_LEN, connection, writer, &flag, &recvSeqNum) != CRC_ERROR &&
+		flag == END_OF_FILE) {
+		sendAck(connection, writer->verdict, recvSeqNum, 0, serverSeqNum);
+	}
+	return LINGER;
+}
+
 //Something Wrong. Data Recovery State.
-STATE recoverData(Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize) {
+STATE recoverData(Connection *connection, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t *expectedSeqNum, uint32_t *serverSeqNum, SrejTimer *srej) {
 	int32_t recvSeqNum = 0, data_len = 0;
-	int32_t index = 0;
-	uint8_t data_buf[MAX_LEN];
+	uint8_t data_buf[bufSize + HEADER_LEN];
 	uint8_t flag;
+	uint64_t now = timeNowUs(), due = srej->srejTime + srej->repairTime / 4 + SREJ_SLACK_USEC;
+	int64_t wait = !srej->adaptive ? LONG_TIME * 1000000LL : due > now ? due - now : 0;
 
-	//Terminates Connection if client is quiet for over 10 secs
-	if (!selectCall(connection->sk_num, LONG_TIME, 0, 1)){
-      return DONE;
-   }
+	if (!selectCall(connection->sk_num, wait / 1000000, wait % 1000000, 1)) {
+		//Terminates Connection if client is quiet for over 10 secs
+		if (!srej->adaptive || timeNowMs() >= srej->heard + LONG_TIME * 1000) {
+			return DONE;
+		}
+		//Nothing since the SREJ went, for twice as long as a repair takes. rCopy's Window may be full
+		//up behind the hole; SREJ it again rather than leave it to rCopy's timer.
+		srejAgain(connection, srej, writer, *expectedSeqNum, serverSeqNum);
+		return DATA_RCV;
+	}
+	srej->heard = timeNowMs();
    
    //Get Data from the client
-   data_len = recv_buf(data_buf, bufSize + 8, connection->sk_num, connection, &flag, &recvSeqNum);
+   data_len = recvClient(data_buf, bufSize + HEADER_LEN, connection, writer, &flag, &recvSeqNum);
    if (data_len == CRC_ERROR) {
    	//Bit Flipped
    	return DATA_RCV;
    }
-   if (recvSeqNum == *expectedSeqNum) {
-   	//Resent packet was what was expected. Write to file.
-   	write(dataFile, &data_buf, data_len);
-   	(*expectedSeqNum)++;
-
-   	//Move things from buffer to file.
-   	return checkBuffer(connection, winBuf, dataFile, bufSize, windowSize, recvSeqNum, expectedSeqNum, serverSeqNum, bufferedDataSize);
-   }
-   else if (recvSeqNum > *expectedSeqNum) {
-   	//Resent Packet is not what was expected; buffer and SREJ 
-   	index = recvSeqNum % windowSize;
-   	memcpy(winBuf[index].buf, data_buf, data_len);
-   	winBuf[index].seqNum = recvSeqNum;
-   	winBuf[index].buf_len = data_len;
-   	winBuf[index].flag = flag;
-   	(*bufferedDataSize)++;
-   	sendAck(connection, SREJ_FLAG, *expectedSeqNum, serverSeqNum);
+   if (flag == WIN_PROBE_FLAG) {
+   	//Still missing a packet; the SREJ carries our Window too
+   	sendAck(connection, SREJ_FLAG, *expectedSeqNum, advertiseRepair(writer), serverSeqNum);
    	return DATA_RCV;
    }
-   else {
-   	//Resent Packet is a lower seqNum than what we want.
-   	//Do nothing w/ the data and SREJ for the original packet.
-   	sendAck(connection, SREJ_FLAG, *expectedSeqNum, serverSeqNum);
-   	return DATA_RCV;
+   if (recvSeqNum == *expectedSeqNum && recvSeqNum == srej->hole) {
+   	//Resent packet was what was expected. Learn how long repairs take.
+   	srej->repairLag += srej->sinceSrej - srej->repairLag / 8;
+   	srej->repairTime += (uint32_t) (timeNowUs() - srej->srejTime) - srej->repairTime / 8;
+   }
+   switch (reorderArrive(reorder, &writer->outlet, expectedSeqNum, recvSeqNum, data_buf, data_len, flag)) {
+   	case ARRIVED_EOF:
+   		//The last packet from the Client, and everything held before it, is on its way to the file.
+   		//ACK it once it is all on disk and hashed, then linger in case it is lost
+   		sendAck(connection, finishFile(writer), *expectedSeqNum - 1, 0, serverSeqNum);
+   		return LINGER;
+   	case ARRIVED_NEXT:
+   		//The hole is filled, and everything held right behind it went to the file in one go
+   		return checkBuffer(connection, reorder, writer, *expectedSeqNum, serverSeqNum, srej);
+   	case ARRIVED_HELD:
+   	case ARRIVED_DROPPED:
+   		//More data past the hole. SREJ the hole (with -s, only if its resend looks lost).
+   		srejHole(connection, srej, writer, *expectedSeqNum, serverSeqNum);
+   		return DATA_RCV;
+   	default:
+   		//Resent Packet is a lower seqNum than what we want.
+   		//Do nothing w/ the data and SREJ for the original packet.
+   		sendAck(connection, SREJ_FLAG, *expectedSeqNum, advertiseRepair(writer), serverSeqNum);
+   		return DATA_RCV;
    }
 }
 
-//Processes the Buffer and moves everything to File if possible
-STATE checkBuffer (Connection *connection, Window *winBuf, int32_t dataFile, int32_t bufSize,
-	int32_t windowSize, int32_t recvSeqNum, int32_t *expectedSeqNum, uint32_t *serverSeqNum, uint32_t *bufferedDataSize) {
-	int32_t index = 0;
-	while (*bufferedDataSize > 0) {
-		//Loops while the buffer isn't empty
-		index = *expectedSeqNum % windowSize;
-		if (*expectedSeqNum == winBuf[index].seqNum) {
-			//What is in the buffer is what we want; Write to file.
-			write(dataFile, winBuf[index].buf, winBuf[index].buf_len);
-			//Update the expected sequence number
-			(*expectedSeqNum)++;
-			//Buffer now "has" one less thing. lower bufferedDataSize 
-			(*bufferedDataSize)--;
-		}
-		else {
-			//Hole in the buffer; SREJ for that packet
-			sendAck(connection, SREJ_FLAG, *expectedSeqNum, serverSeqNum);
-			return DATA_RCV;
-		}
-	}
-	if (winBuf[index].flag == END_OF_FILE) {
-		//Buffer Empty; The packet in the buffer was the last from the Client.
-		//Send ACK for it, then close connection
-		sendAck(connection, END_OF_FILE, recvSeqNum, serverSeqNum);
-		return DONE;
+//A hole was filled and what it uncovered written. SREJ the next hole, if there is one.
+STATE checkBuffer (Connection *connection, Reorder *reorder, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum,
+	SrejTimer *srej) {
+	if (reorder->count > 0) {
+		//Hole in the buffer; SREJ for that packet
+		srejHole(connection, srej, writer, expectedSeqNum, serverSeqNum);
+		return DATA_RCV;
 	}
 	else {
 		//Buffer Empty; Send RR for the next packet.
 		//Return to READ_DATA state
-		sendAck(connection, RR_FLAG, recvSeqNum, serverSeqNum);
+		sendAck(connection, RR_FLAG, expectedSeqNum - 1, advertise(writer), serverSeqNum);
 		return READ_DATA;
 	}
+}
+
+//SREJ the hole for a packet that arrived past it. Adaptive SREJs only ask the first time the hole
+//is seen, since every packet past it otherwise gets the same packet resent; they ask again
+//once far more packets than usual have come in since, meaning the resend was lost.
+void srejHole(Connection *connection, SrejTimer *srej, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum) {
+	srej->heard = timeNowMs();
+	if (!srej->adaptive || srej->hole != expectedSeqNum || ++srej->sinceSrej > srej->repairLag / 4 + SREJ_SLACK) {
+		srejAgain(connection, srej, writer, expectedSeqNum, serverSeqNum);
+	}
+}
 
+void srejAgain(Connection *connection, SrejTimer *srej, Writer *writer, int32_t expectedSeqNum, uint32_t *serverSeqNum) {
+	sendAck(connection, SREJ_FLAG, expectedSeqNum, advertiseRepair(writer), serverSeqNum);
+	srej->hole = expectedSeqNum;
+	srej->sinceSrej = 0;
+	srej->srejTime = timeNowUs();
 }
 
+//Process a Multicast Session. Data comes in on the group, repairs on our own socket.
+void processGroup(int32_t groupSkNum, uint8_t *buf, int32_t recvLen, Connection *client, Options *options, Pool *pool) {
+	STATE state = READ_DATA, lastState = READ_DATA;
+	int32_t dataFile = 0;
+	int32_t bufSize = 0;
+	int32_t windowSize = 0;
+	int32_t seqNum = START_SEQ_NUM;
+	uint32_t serverSeqNum = 1;
+	int32_t priority = PRIORITY_NORMAL;
+	Reorder reorder;
+	Group group;
+	Writer writer;
+
+	//No Chunk store for a group; its receivers don't share one. Nor pacing: the sender goes at the slowest receiver's pace.
+	if (fileName(client, buf, recvLen, &dataFile, &bufSize, &windowSize, &priority, options->maxBufSize, 0, pool) == DONE) {
+		close(client->sk_num);
+		return;
+	}
+	reorderInit(&reorder, pool, windowSize, bufSize);
+	startWriter(&writer, &reorder, dataFile, bufSize, windowSize, options->ringDepth, NULL);
+
+	//NAKs also go to the group so the other receivers can hold theirs back
+	group.groupSk = groupSkNum;
+	group.peers.sk_num = client->sk_num;
+	group.peers.len = sizeof(struct sockaddr_in);
+	group.peers.remote.sin_family = AF_INET;
+	group.peers.remote.sin_port = htons(options->portNum);
+	inet_aton(options->group, &group.peers.remote.sin_addr);
+	mcastSenderSetup(&group.peers, options->iface);
+	group.nakSeq = 0;
+	group.nakDue = 0;
+	group.sinceAck = 0;
+	group.ackDue = 0;
+	group.lastHeard = timeNowMs();
+	group.lastAck = group.lastHeard;
+	srandom(getpid() ^ group.lastHeard);
 
+	while (state != DONE) {
+		state = groupData(&group, client, &reorder, &writer, bufSize, windowSize, &seqNum, &serverSeqNum, state);
+		if (state != lastState) {
+			traceEvent(TRACE_STATE, state, 0, 0, lastState);
+			lastState = state;
+		}
+	}
+
+	finishWriter(&writer);
+	close(dataFile);
+	close(client->sk_num);
+	reorderFree(&reorder);
+}
+
+//Wait for a packet or for a NAK/RR to come due, then handle whichever happened
+STATE groupData(Group *group, Connection *client, Reorder *reorder, Writer *writer, int32_t bufSize,
+	int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum, STATE state) {
+	uint8_t flag = 0, data_buf[bufSize + HEADER_LEN];
+	int32_t recvSeqNum = 0, data_len = 0, ready = 0, ackEvery = windowSize / 4 > 0 ? windowSize / 4 : 1;
+	uint64_t now = timeNowMs();
+	uint64_t due = group->lastHeard + (state == LINGER ? LINGER_TIME : LONG_TIME * 1000);
+	int64_t wait = 0;
+	Connection from;
+
+	if (group->nakDue && group->nakDue < due) {
+		due = group->nakDue;
+	}
+	if (group->sinceAck && group->ackDue < due) {
+		due = group->ackDue;
+	}
+	if (state != LINGER && group->lastAck + SHORT_TIME * 1000 < due) {
+		due = group->lastAck + SHORT_TIME * 1000;
+	}
+	if (writer->advertised / 2 < (uint32_t) ackEvery) {
+		//Small advertised Window; don't let the sender use it all up before hearing from us
+		ackEvery = writer->advertised / 2 > 0 ? writer->advertised / 2 : 1;
+	}
+	if (state != LINGER && writer->advertised == 0 && now + 1 < due) {
+		//Sender was told to stop; check on the disk again shortly
+		due = now + 1;
+	}
+	wait = due > now ? due - now : 0;
+
+	if ((ready = selectPair(group->groupSk, client->sk_num, wait / 1000, (wait % 1000) * 1000)) != 0) {
+		data_len = recv_buf(data_buf, bufSize + HEADER_LEN, (ready & 1) ? group->groupSk : client->sk_num, &from, &flag, &recvSeqNum);
+		if (data_len != CRC_ERROR) {
+			state = groupPacket(group, client, &from, reorder, writer, data_buf, data_len, flag, recvSeqNum, bufSize, windowSize,
+				expectedSeqNum, serverSeqNum, state);
+			if (state == DONE) {
+				return DONE;
+			}
+		}
+	}
+	now = timeNowMs();
+
+	if (state != LINGER && group->nakDue && now >= group->nakDue) {
+		//Nobody else asked for the hole; NAK it ourselves
+		sendAck(client, SREJ_FLAG, *expectedSeqNum, advertiseRepair(writer), serverSeqNum);
+		sendAck(&group->peers, SREJ_FLAG, *expectedSeqNum, advertiseRepair(writer), serverSeqNum);
+		group->nakDue = now + MC_NAK_RETRY;
+	}
+	if (state != LINGER && writer->advertised == 0 && advertise(writer) > 0) {
+		//Disk caught up. Reopen the sender's Window now instead of at the next heartbeat.
+		group->lastAck = 0;
+	}
+	if (state != LINGER && ((group->sinceAck && (group->sinceAck >= ackEvery || now >= group->ackDue)) ||
+		now >= group->lastAck + SHORT_TIME * 1000)) {
+		//RR every few packets, and at least once a second so the sender knows we're still here
+		sendAck(client, RR_FLAG, *expectedSeqNum - 1, advertise(writer), serverSeqNum);
+		group->sinceAck = 0;
+		group->lastAck = now;
+	}
+	if (now >= group->lastHeard + (state == LINGER ? LINGER_TIME : LONG_TIME * 1000)) {
+		//Sender is finished with us, or gone
+		return DONE;
+	}
+	return state;
+}
+
+//Handle one packet from the group or one repair sent just to us
+STATE groupPacket(Group *group, Connection *client, Connection *from, Reorder *reorder, Writer *writer, uint8_t *data_buf, int32_t data_len,
+	uint8_t flag, int32_t recvSeqNum, int32_t bufSize, int32_t windowSize, int32_t *expectedSeqNum, uint32_t *serverSeqNum,
+	STATE state) {
+	uint64_t now = timeNowMs();
+	uint8_t packet[MAX_LEN];
+	int32_t arrived = 0;
+	int32_t nakSeq = 0;
+
+	if (flag == SREJ_FLAG) {
+		//Another receiver NAKed. If it's our hole too, wait for the repair instead.
+		memcpy(&nakSeq, data_buf, sizeof(int32_t));
+		if (group->nakDue && nakSeq == *expectedSeqNum) {
+			group->nakDue = now + MC_NAK_RETRY;
+		}
+		return state;
+	}
+	if (!sameAddr(&from->remote, &client->remote)) {
+		//Some other sender's session on this group
+		return state;
+	}
+	if (flag == REMOTE_FN_FLAG) {
+		//Sender is still collecting receivers; answer again
+		fileGood(client, bufSize, windowSize, 0, packet);
+		return state;
+	}
+	if (flag == WIN_PROBE_FLAG) {
+		//Sender's Window is shut; our reopening RR may have been lost. Send one now.
+		group->lastHeard = now;
+		group->lastAck = 0;
+		return state;
+	}
+	if (flag != DATA_FLAG && flag != HOLE_FLAG && flag != END_OF_FILE) {
+		return state;
+	}
+	group->lastHeard = now;
+
+	if (state == LINGER) {
+		//Our EOF ACK was lost
+		if (flag == END_OF_FILE) {
+			sendAck(client, writer->verdict, *expectedSeqNum - 1, 0, serverSeqNum);
+		}
+		return LINGER;
+	}
+
+	arrived = reorderArrive(reorder, &writer->outlet, expectedSeqNum, recvSeqNum, data_buf, data_len, flag);
+	if (arrived == ARRIVED_EOF) {
+		sendAck(client, finishFile(writer), *expectedSeqNum - 1, 0, serverSeqNum);
+		return LINGER;
+	}
+	if (arrived == ARRIVED_NEXT) {
+		//Data was what was expected. It went to the file, then anything buffered behind it.
+		if (group->nakDue) {
+			//A repair filled our hole. RR straight away, the sender may be stalled on us.
+			group->lastAck = 0;
+		}
+		else if (group->sinceAck++ == 0) {
+			group->ackDue = now + MC_ACK_DELAY;
+		}
+		group->nakDue = 0;
+		if (reorder->count > 0) {
+			//Still a hole below what's buffered
+			scheduleNak(group, *expectedSeqNum, now);
+		}
+	}
+	else if (arrived != ARRIVED_OLD && recvSeqNum < *expectedSeqNum + windowSize) {
+		//Unexpected Data, now buffered. Get ready to NAK the hole.
+		scheduleNak(group, *expectedSeqNum, now);
+	}
+	//Anything else is a repair we didn't need
+	return READ_DATA;
+}
+
+//NAK after a random backoff so one receiver's NAK can stand in for everyone's
+void scheduleNak(Group *group, int32_t expectedSeqNum, uint64_t now) {
+	if (group->nakDue == 0 || group->nakSeq != expectedSeqNum) {
+		group->nakSeq = expectedSeqNum;
+		group->nakDue = now + random() % (MC_NAK_BACKOFF + 1);
+	}
+}
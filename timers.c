@@ -0,0 +1,232 @@
+/*
+ * Hierarchical Timer Wheel used by rCopy for per packet
+ * retransmission timers. Adding, cancelling and expiring
+ * a timer are all constant time, no matter how many packets
+ * are in flight.
+ */
+#include "networks.h"
+#include "timers.h"
+
+static void timerUnlink(TimerNode *node);
+static int32_t levelShift(int32_t level);
+static void cascade(TimerWheel *wheel, int32_t level, int32_t index);
+
+//Current Time in Milliseconds. Monotonic, so setting the clock doesn't fire or stall timers.
+uint64_t timeNowMs(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//Current Time in Microseconds, on the same clock
+uint64_t timeNowUs(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//Empty every slot on every level
+void wheelInit(TimerWheel *wheel, uint64_t now) {
+	int32_t level = 0, index = 0;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (index = 0; index < WHEEL_ROOT_SIZE; index++) {
+			wheel->slots[level][index].next = &wheel->slots[level][index];
+			wheel->slots[level][index].prev = &wheel->slots[level][index];
+		}
+	}
+	wheel->tick = now;
+	wheel->count = 0;
+}
+
+void timerInit(TimerNode *node, int32_t index) {
+	node->next = NULL;
+	node->prev = NULL;
+	node->expires = 0;
+	node->index = index;
+}
+
+int timerArmed(TimerNode *node) {
+	return node->prev != NULL;
+}
+
+//Place the timer in the slot matching how far away it expires
+void wheelAdd(TimerWheel *wheel, TimerNode *node, uint64_t expires) {
+	TimerNode *head = NULL;
+	uint64_t delta = 0;
+	int32_t level = 0;
+
+	if (timerArmed(node)) {
+		wheelCancel(wheel, node);
+	}
+	if (expires < wheel->tick) {
+		expires = wheel->tick;
+	}
+	delta = expires - wheel->tick;
+	if (delta > WHEEL_MAX_DELTA) {
+		expires = wheel->tick + WHEEL_MAX_DELTA;
+		delta = WHEEL_MAX_DELTA;
+	}
+	node->expires = expires;
+
+	if (delta < WHEEL_ROOT_SIZE) {
+		head = &wheel->slots[0][expires & (WHEEL_ROOT_SIZE - 1)];
+	}
+	else {
+		for (level = 1; level < WHEEL_LEVELS - 1; level++) {
+			if (delta < (1ULL << levelShift(level + 1))) {
+				break;
+			}
+		}
+		head = &wheel->slots[level][(expires >> levelShift(level)) & (WHEEL_LEVEL_SIZE - 1)];
+	}
+
+	node->next = head;
+	node->prev = head->prev;
+	head->prev->next = node;
+	head->prev = node;
+	wheel->count++;
+}
+
+void wheelCancel(TimerWheel *wheel, TimerNode *node) {
+	if (timerArmed(node)) {
+		timerUnlink(node);
+		wheel->count--;
+	}
+}
+
+//Move the wheel up to now. Returns the expired timers as a list linked through next.
+TimerNode *wheelAdvance(TimerWheel *wheel, uint64_t now) {
+	TimerNode *expired = NULL, *head = NULL, *node = NULL;
+	int32_t index = 0, level = 0, levelIndex = 0;
+
+	while (wheel->count > 0 && wheel->tick <= now) {
+		index = wheel->tick & (WHEEL_ROOT_SIZE - 1);
+		if (index == 0) {
+			//Root wrapped. Pull the next slot of each coarser level down.
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				levelIndex = (wheel->tick >> levelShift(level)) & (WHEEL_LEVEL_SIZE - 1);
+				cascade(wheel, level, levelIndex);
+				if (levelIndex != 0) {
+					break;
+				}
+			}
+		}
+
+		head = &wheel->slots[0][index];
+		while (head->next != head) {
+			node = head->next;
+			timerUnlink(node);
+			wheel->count--;
+			node->next = expired;
+			expired = node;
+		}
+		wheel->tick++;
+	}
+	if (wheel->count == 0 && wheel->tick <= now) {
+		//Nothing left to time; skip the idle ticks
+		wheel->tick = now + 1;
+	}
+	return expired;
+}
+
+//Milliseconds until the wheel needs advancing again; -1 if nothing is armed
+int64_t wheelNextTimeout(TimerWheel *wheel, uint64_t now) {
+	uint64_t tick = wheel->tick;
+	int32_t offset = 0;
+
+	if (wheel->count == 0) {
+		return -1;
+	}
+	for (offset = 0; offset < WHEEL_ROOT_SIZE; offset++) {
+		if (offset > 0 && ((tick + offset) & (WHEEL_ROOT_SIZE - 1)) == 0) {
+			//Next cascade point; coarser levels may have something due
+			break;
+		}
+		if (wheel->slots[0][(tick + offset) & (WHEEL_ROOT_SIZE - 1)].next !=
+			&wheel->slots[0][(tick + offset) & (WHEEL_ROOT_SIZE - 1)]) {
+			break;
+		}
+	}
+	if (tick + offset <= now) {
+		return 0;
+	}
+	return tick + offset - now;
+}
+
+//Start the estimator off at the old fixed timeout
+void rttInit(RttState *rtt) {
+	rtt->srtt = 0;
+	rtt->rttvar = 0;
+	rtt->rto = INITIAL_RTO;
+}
+
+//Fold a round trip sample into the estimate and recompute the RTO
+void rttSample(RttState *rtt, int64_t sample) {
+	int64_t delta = 0;
+
+	if (sample < 0) {
+		return;
+	}
+	if (rtt->srtt == 0) {
+		rtt->srtt = sample;
+		rtt->rttvar = sample / 2;
+	}
+	else {
+		delta = rtt->srtt - sample;
+		if (delta < 0) {
+			delta = -delta;
+		}
+		rtt->rttvar = (3 * rtt->rttvar + delta) / 4;
+		rtt->srtt = (7 * rtt->srtt + sample) / 8;
+	}
+	rtt->rto = rtt->srtt + (rtt->rttvar * 4 > 1 ? rtt->rttvar * 4 : 1);
+	if (rtt->rto < MIN_RTO) {
+		rtt->rto = MIN_RTO;
+	}
+	if (rtt->rto > MAX_RTO) {
+		rtt->rto = MAX_RTO;
+	}
+}
+
+static void timerUnlink(TimerNode *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->next = NULL;
+	node->prev = NULL;
+}
+
+//Bit position the given level is indexed from
+static int32_t levelShift(int32_t level) {
+	if (level == 0) {
+		return 0;
+	}
+	return WHEEL_ROOT_BITS + (level - 1) * WHEEL_LEVEL_BITS;
+}
+
+//Re-add everything in a coarse slot so it lands on a finer level
+static void cascade(TimerWheel *wheel, int32_t level, int32_t index) {
+	TimerNode *head = &wheel->slots[level][index];
+	TimerNode *node = NULL;
+	TimerNode pending;
+
+	if (head->next == head) {
+		return;
+	}
+	//Detach the whole slot first so re-adds can't land back in it
+	pending.next = head->next;
+	pending.prev = head->prev;
+	pending.next->prev = &pending;
+	pending.prev->next = &pending;
+	head->next = head;
+	head->prev = head;
+
+	while (pending.next != &pending) {
+		node = pending.next;
+		timerUnlink(node);
+		wheel->count--;
+		wheelAdd(wheel, node, node->expires);
+	}
+}
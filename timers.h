@@ -0,0 +1,57 @@
+#ifndef _TIMERS_H_
+#define _TIMERS_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+//Timer Wheel Geometry. Ticks are in milliseconds.
+//Level 0 holds the next 256 ticks, each level above is 64 times coarser.
+#define WHEEL_LEVELS 4
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_ROOT_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS)) - 1)
+
+//Retransmission Timeout Bounds (msec)
+#define INITIAL_RTO (SHORT_TIME * 1000)
+#define MIN_RTO 200
+#define MAX_RTO (LONG_TIME * 1000)
+
+//Struct Declaration for a Timer. Lives inside whatever it is timing.
+typedef struct timerNode TimerNode;
+struct timerNode {
+	TimerNode *next;
+	TimerNode *prev;
+	uint64_t expires;
+	int32_t index;
+};
+
+//Struct Declaration for a Timer Wheel
+typedef struct {
+	TimerNode slots[WHEEL_LEVELS][WHEEL_ROOT_SIZE];
+	uint64_t tick;
+	uint32_t count;
+} TimerWheel;
+
+//Struct Declaration for Round Trip Estimation (RFC 6298)
+typedef struct {
+	int64_t srtt;
+	int64_t rttvar;
+	int64_t rto;
+} RttState;
+
+//Headers for Functions in timers.c
+uint64_t timeNowMs(void);
+uint64_t timeNowUs(void);
+void wheelInit(TimerWheel *wheel, uint64_t now);
+void timerInit(TimerNode *node, int32_t index);
+int timerArmed(TimerNode *node);
+void wheelAdd(TimerWheel *wheel, TimerNode *node, uint64_t expires);
+void wheelCancel(TimerWheel *wheel, TimerNode *node);
+TimerNode *wheelAdvance(TimerWheel *wheel, uint64_t now);
+int64_t wheelNextTimeout(TimerWheel *wheel, uint64_t now);
+void rttInit(RttState *rtt);
+void rttSample(RttState *rtt, int64_t sample);
+#endif
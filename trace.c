@@ -0,0 +1,214 @@
+/*
+ * Binary event trace. Each thread records into a lock free ring of
+ * its own; a flusher thread writes the rings out every so often,
+ * so recording a packet never waits on the disk. tracedump turns
+ * the file into something to read.
+ */
+#include <pthread.h>
+#include <time.h>
+
+#include "networks.h"
+#include "ring.h"
+#include "trace.h"
+
+//Struct Declaration for a Thread's Trace Ring.
+//head is only written by the recording thread, tail only by the flusher.
+//owned is cleared when the thread exits, so the next new thread can take the ring over.
+typedef struct traceRing TraceRing;
+struct traceRing {
+	TraceRecord records[TRACE_RING_LEN];
+	TraceRing *next;
+	uint32_t dropped;
+	uint32_t reported;
+	int32_t owned;
+	uint16_t thread;
+	uint32_t head __attribute__((aligned(CACHE_LINE)));
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));
+};
+
+static int32_t traceOn = 0;
+static int32_t traceFile = -1;
+static char *tracePath = NULL;
+static TraceRing *rings = NULL;
+static uint16_t threads = 0;
+static int32_t flusherStop = 0;
+static pthread_t flusher;
+static pthread_key_t ringKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static __thread TraceRing *myRing = NULL;
+
+static void traceOpen(char *path);
+static void keyInit(void);
+static void ringDone(void *arg);
+static TraceRing *traceRegister(void);
+static void *flusherThread(void *arg);
+static void traceDrain(void);
+static void traceWrite(void *buf, size_t len);
+
+//Record into path until the process exits
+void traceStart(char *path) {
+	tracePath = path;
+	traceOpen(path);
+	atexit(traceStop);
+}
+
+//A forked child can't share its parent's file or flusher. It records into path.<pid> instead.
+void traceFork(void) {
+	char path[strlen(tracePath != NULL ? tracePath : "") + 16];
+
+	if (!traceOn) {
+		return;
+	}
+	//The parent flushes its own rings; start over with none
+	traceOn = 0;
+	close(traceFile);
+	rings = NULL;
+	threads = 0;
+	myRing = NULL;
+	snprintf(path, sizeof(path), "%s.%d", tracePath, getpid());
+	traceOpen(path);
+}
+
+static void traceOpen(char *path) {
+	TraceHeader header;
+
+	if ((traceFile = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666)) < 0) {
+		perror("traceStart, open");
+		exit(-1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.recordLen = sizeof(TraceRecord);
+	header.pid = getpid();
+	traceWrite(&header, sizeof(header));
+
+	pthread_once(&keyOnce, keyInit);
+	flusherStop = 0;
+	if (pthread_create(&flusher, NULL, flusherThread, NULL) != 0) {
+		perror("traceStart, pthread_create");
+		exit(-1);
+	}
+	__atomic_store_n(&traceOn, 1, __ATOMIC_RELEASE);
+}
+
+//Write out whatever is left. Runs at exit.
+void traceStop(void) {
+	if (!__atomic_load_n(&traceOn, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&traceOn, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&flusherStop, 1, __ATOMIC_RELEASE);
+	pthread_join(flusher, NULL);
+	close(traceFile);
+}
+
+//Record one event. Costs a clock read and a copy; drops the record if the flusher is behind.
+void traceEvent(uint8_t event, uint32_t seq, uint8_t flag, int32_t len, uint32_t aux) {
+	TraceRing *ring = myRing;
+	TraceRecord *record = NULL;
+	struct timespec now;
+
+	if (!__atomic_load_n(&traceOn, __ATOMIC_RELAXED)) {
+		return;
+	}
+	if (ring == NULL && (ring = traceRegister()) == NULL) {
+		return;
+	}
+	if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_LEN) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record = &ring->records[ring->head & TRACE_RING_MASK];
+	record->usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	record->seq = seq;
+	record->len = len;
+	record->aux = aux;
+	record->thread = ring->thread;
+	record->event = event;
+	record->flag = flag;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void keyInit(void) {
+	pthread_key_create(&ringKey, ringDone);
+}
+
+//Thread is exiting. Its ring stays on the list until someone new takes it.
+static void ringDone(void *arg) {
+	TraceRing *ring = arg;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+//First event from this thread. Take over a ring left by a finished thread, or add a new one.
+static TraceRing *traceRegister(void) {
+	TraceRing *ring = NULL;
+	int32_t owned = 0;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		owned = 0;
+		if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		if ((ring = calloc(1, sizeof(TraceRing))) == NULL) {
+			return NULL;
+		}
+		ring->owned = 1;
+		ring->thread = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED);
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+	}
+	pthread_setspecific(ringKey, ring);
+	myRing = ring;
+	return ring;
+}
+
+static void *flusherThread(void *arg) {
+	while (!__atomic_load_n(&flusherStop, __ATOMIC_ACQUIRE)) {
+		traceDrain();
+		usleep(TRACE_FLUSH_USEC);
+	}
+	traceDrain();
+	return NULL;
+}
+
+//Write out every ring's records, oldest first. Lost records are noted with one TRACE_DROPPED.
+static void traceDrain(void) {
+	TraceRing *ring = NULL;
+	TraceRecord lost;
+	struct timespec now;
+	uint32_t head = 0, start = 0, count = 0, dropped = 0;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (ring->tail != head) {
+			//Up to the end of the ring at most; the rest on the next pass
+			start = ring->tail & TRACE_RING_MASK;
+			count = head - ring->tail < TRACE_RING_LEN - start ? head - ring->tail : TRACE_RING_LEN - start;
+			traceWrite(&ring->records[start], count * sizeof(TraceRecord));
+			__atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+		}
+		if ((dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED)) != ring->reported) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			memset(&lost, 0, sizeof(lost));
+			lost.usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+			lost.aux = dropped - ring->reported;
+			lost.thread = ring->thread;
+			lost.event = TRACE_DROPPED;
+			traceWrite(&lost, sizeof(lost));
+			ring->reported = dropped;
+		}
+	}
+}
+
+//A trace is only for debugging. If it can't be written, stop tracing and carry on.
+static void traceWrite(void *buf, size_t len) {
+	if (write(traceFile, buf, len) != len) {
+		perror("trace, write");
+		__atomic_store_n(&traceOn, 0, __ATOMIC_RELEASE);
+	}
+}
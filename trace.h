@@ -0,0 +1,54 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+//Records each thread can have waiting for the flusher. Past that, records are dropped and counted.
+#define TRACE_RING_LEN 65536
+#define TRACE_RING_MASK (TRACE_RING_LEN - 1)
+
+//How often the flusher writes out what's waiting (usec)
+#define TRACE_FLUSH_USEC 10000
+
+//Start of every trace file, so tracedump can check what it was given
+#define TRACE_MAGIC "RCTR"
+#define TRACE_VERSION 1
+
+//Event Types
+#define TRACE_SEND 1
+#define TRACE_RESEND 2
+#define TRACE_RECV 3
+#define TRACE_CRC_ERROR 4
+#define TRACE_SREJ 5
+#define TRACE_TIMEOUT 6
+#define TRACE_STATE 7
+#define TRACE_DROPPED 8
+
+//Struct Declaration for a Trace File Header. Written in host byte order.
+typedef struct {
+	char magic[4];
+	uint16_t version;
+	uint16_t recordLen;
+	uint32_t pid;
+	uint32_t reserved;
+} TraceHeader;
+
+//Struct Declaration for a Trace Record.
+//usec is CLOCK_MONOTONIC. For TRACE_STATE, seq is the new state and aux the old one.
+//aux is otherwise the send count (RESEND/TIMEOUT), the Window offered (SREJ) or records lost (DROPPED).
+typedef struct {
+	uint64_t usec;
+	uint32_t seq;
+	int32_t len;
+	uint32_t aux;
+	uint16_t thread;
+	uint8_t event;
+	uint8_t flag;
+} TraceRecord;
+
+//Headers for Functions in trace.c
+void traceStart(char *path);
+void traceFork(void);
+void traceStop(void);
+void traceEvent(uint8_t event, uint32_t seq, uint8_t flag, int32_t len, uint32_t aux);
+#endif
@@ -0,0 +1,201 @@
+/*
+ * Offline reader for rCopy/Server traces (-t traceFile). Prints the
+ * trace as a time sequence, either a line per interval or a line per
+ * record, followed by summary statistics for the whole run.
+ */
+#include <inttypes.h>
+
+#include "networks.h"
+#include "trace.h"
+
+//Default length of one line of the time sequence (msec)
+#define DEFAULT_INTERVAL 100
+
+//Struct Declaration for the Counts over some span of the Trace
+typedef struct {
+	uint64_t sent;
+	uint64_t sentBytes;
+	uint64_t dataSent;
+	uint64_t dataBytes;
+	uint64_t recv;
+	uint64_t recvBytes;
+	uint64_t events[TRACE_DROPPED + 1];
+} Counts;
+
+static const char *eventNames[] = {"?", "SEND", "RESEND", "RECV", "CRC_ERROR", "SREJ", "TIMEOUT", "STATE", "DROPPED"};
+
+//Function Headers
+TraceRecord *readTrace(char *path, TraceHeader *header, uint32_t *count);
+int compareRecords(const void *first, const void *second);
+void countRecord(Counts *counts, TraceRecord *record);
+void printInterval(uint64_t start, Counts *counts);
+void printRecord(uint64_t start, TraceRecord *record);
+void printSummary(TraceHeader *header, TraceRecord *records, uint32_t count, Counts *total);
+
+
+int main(int argc, char *argv[]) {
+	TraceHeader header;
+	TraceRecord *records = NULL;
+	Counts total, interval;
+	uint32_t count = 0, index = 0;
+	uint64_t intervalUsec = DEFAULT_INTERVAL * 1000, start = 0, lineStart = 0;
+	int32_t raw = 0, arg = 2;
+
+	if (argc < 2) {
+		printf("Usage: %s traceFile [-i interval(ms)] [-r]\n", argv[0]);
+		exit(-1);
+	}
+	for (; arg < argc; arg++) {
+		if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc) {
+			if (atoi(argv[++arg]) < 1) {
+				printf("Invalid interval. (Must be at least 1 ms)\n");
+				exit(-1);
+			}
+			intervalUsec = atoi(argv[arg]) * 1000ULL;
+		}
+		else if (strcmp(argv[arg], "-r") == 0) {
+			//A line per record instead of per interval
+			raw = 1;
+		}
+		else {
+			printf("Unknown option: %s\n", argv[arg]);
+			exit(-1);
+		}
+	}
+
+	records = readTrace(argv[1], &header, &count);
+	//Each thread's records were written a ring at a time; put them back in time order
+	qsort(records, count, sizeof(TraceRecord), compareRecords);
+	start = count > 0 ? records[0].usec : 0;
+
+	memset(&total, 0, sizeof(total));
+	memset(&interval, 0, sizeof(interval));
+	if (raw) {
+		printf("%10s %6s %-9s %4s %10s %6s %10s\n", "time(ms)", "thread", "event", "flag", "seq", "len", "aux");
+	}
+	else {
+		printf("%10s %8s %10s %8s %8s %10s %5s %6s %8s\n", "time(ms)", "sent", "sentBytes", "resent", "recv", "recvBytes",
+			"crc", "srej", "timeouts");
+	}
+	for (index = 0, lineStart = start; index < count; index++) {
+		if (raw) {
+			printRecord(start, &records[index]);
+		}
+		while (!raw && records[index].usec >= lineStart + intervalUsec) {
+			//Quiet intervals get a line too, so the sequence has no gaps
+			printInterval(lineStart - start, &interval);
+			memset(&interval, 0, sizeof(interval));
+			lineStart += intervalUsec;
+		}
+		countRecord(&interval, &records[index]);
+		countRecord(&total, &records[index]);
+	}
+	if (!raw && count > 0) {
+		printInterval(lineStart - start, &interval);
+	}
+	printSummary(&header, records, count, &total);
+	free(records);
+	return 0;
+}
+
+//Load every record in the file
+TraceRecord *readTrace(char *path, TraceHeader *header, uint32_t *count) {
+	FILE *file = NULL;
+	TraceRecord *records = NULL;
+	uint32_t size = 1024;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		perror("readTrace, fopen");
+		exit(-1);
+	}
+	if (fread(header, sizeof(TraceHeader), 1, file) != 1 || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) {
+		printf("%s is not a trace file.\n", path);
+		exit(-1);
+	}
+	if (header->version != TRACE_VERSION || header->recordLen != sizeof(TraceRecord)) {
+		printf("%s is trace version %d; this reads version %d.\n", path, header->version, TRACE_VERSION);
+		exit(-1);
+	}
+	if ((records = malloc(size * sizeof(TraceRecord))) == NULL) {
+		perror("readTrace, malloc");
+		exit(-1);
+	}
+	*count = 0;
+	while (fread(&records[*count], sizeof(TraceRecord), 1, file) == 1) {
+		if (++(*count) == size && (records = realloc(records, (size *= 2) * sizeof(TraceRecord))) == NULL) {
+			perror("readTrace, realloc");
+			exit(-1);
+		}
+	}
+	fclose(file);
+	return records;
+}
+
+int compareRecords(const void *first, const void *second) {
+	const TraceRecord *one = first, *two = second;
+
+	if (one->usec != two->usec) {
+		return one->usec < two->usec ? -1 : 1;
+	}
+	return (int) one->thread - (int) two->thread;
+}
+
+//Data is file content the Window carries. The EOF flag is left out, since the Server ACKs with it too.
+void countRecord(Counts *counts, TraceRecord *record) {
+	if (record->event > TRACE_DROPPED) {
+		return;
+	}
+	counts->events[record->event] += (record->event == TRACE_DROPPED) ? record->aux : 1;
+	if (record->event == TRACE_SEND) {
+		counts->sent++;
+		counts->sentBytes += record->len;
+		if (record->flag == DATA_FLAG || record->flag == HOLE_FLAG || record->flag == CHUNK_REF_FLAG) {
+			counts->dataSent++;
+			counts->dataBytes += record->len;
+		}
+	}
+	else if (record->event == TRACE_RECV) {
+		counts->recv++;
+		counts->recvBytes += record->len;
+	}
+}
+
+void printInterval(uint64_t start, Counts *counts) {
+	printf("%10.1f %8" PRIu64 " %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10" PRIu64 " %5" PRIu64 " %6" PRIu64 " %8" PRIu64 "\n",
+		start / 1000.0, counts->sent, counts->sentBytes,
+		counts->events[TRACE_RESEND], counts->recv, counts->recvBytes, counts->events[TRACE_CRC_ERROR],
+		counts->events[TRACE_SREJ], counts->events[TRACE_TIMEOUT]);
+}
+
+void printRecord(uint64_t start, TraceRecord *record) {
+	const char *name = record->event <= TRACE_DROPPED ? eventNames[record->event] : eventNames[0];
+
+	printf("%10.3f %6u %-9s %4u %10u %6d %10u\n", (record->usec - start) / 1000.0, record->thread, name, record->flag,
+		record->seq, record->len, record->aux);
+}
+
+void printSummary(TraceHeader *header, TraceRecord *records, uint32_t count, Counts *total) {
+	double seconds = count > 1 ? (records[count - 1].usec - records[0].usec) / 1000000.0 : 0;
+	uint32_t threads = 0, index = 0;
+
+	for (index = 0; index < count; index++) {
+		threads = records[index].thread >= threads ? records[index].thread + 1 : threads;
+	}
+	printf("\nTrace of pid %u: %u records from %u threads over %.3f s\n", header->pid, count, threads, seconds);
+	printf("Sent:       %" PRIu64 " packets, %" PRIu64 " bytes (%" PRIu64 " data packets, %" PRIu64 " bytes)\n", total->sent, total->sentBytes,
+		total->dataSent, total->dataBytes);
+	printf("Resent:     %" PRIu64 " (%.2f%% of data packets)\n", total->events[TRACE_RESEND],
+		total->dataSent > 0 ? 100.0 * total->events[TRACE_RESEND] / total->dataSent : 0);
+	printf("Received:   %" PRIu64 " packets, %" PRIu64 " bytes\n", total->recv, total->recvBytes);
+	printf("CRC errors: %" PRIu64 "\n", total->events[TRACE_CRC_ERROR]);
+	printf("SREJs:      %" PRIu64 "\n", total->events[TRACE_SREJ]);
+	printf("Timeouts:   %" PRIu64 "\n", total->events[TRACE_TIMEOUT]);
+	printf("States:     %" PRIu64 " changes\n", total->events[TRACE_STATE]);
+	if (seconds > 0) {
+		printf("Rate:       %.1f KB/s sent, %.1f KB/s received\n", total->sentBytes / seconds / 1024,
+			total->recvBytes / seconds / 1024);
+	}
+	if (total->events[TRACE_DROPPED] > 0) {
+		printf("Dropped:    %" PRIu64 " records; the flusher fell behind\n", total->events[TRACE_DROPPED]);
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * rCopy's send side of the Ring: data the disk thread read ahead
+ * is moved from the Ring into the Window before it is sent. Kept
+ * apart from rcopy.c so the benchmarks can time it too.
+ */
+#include "networks.h"
+#include "window.h"
+
+//Load Data read ahead by the Disk Thread into the Window
+int32_t loadData (Window *winBuf, Ring *ring, int32_t windowSize, uint32_t *seqNum) {
+	RingSlot *slot = NULL;
+	int index = *seqNum % windowSize;
+
+	if ((slot = ringConsume(ring)) == NULL) {
+		//Nothing read yet
+		return -1;
+	}
+	memcpy(winBuf[index].buf, slot->buf, slot->buf_len);
+	winBuf[index].seqNum = *seqNum;
+	winBuf[index].buf_len = slot->buf_len;
+	winBuf[index].flag = slot->flag;
+	winBuf[index].tries = 0;
+	winBuf[index].nakMask = 0;
+	winBuf[index].nakTime = 0;
+	ringRelease(ring);
+
+	if (winBuf[index].flag != END_OF_FILE) {
+		//Data fills up buffer
+		(*seqNum)++;
+	}
+	return index;
+}
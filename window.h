@@ -0,0 +1,11 @@
+#ifndef _WINDOW_H_
+#define _WINDOW_H_
+
+#include <stdint.h>
+
+#include "networks.h"
+#include "ring.h"
+
+//Headers for Functions in window.c
+int32_t loadData (Window *winBuf, Ring *ring, int32_t windowSize, uint32_t *seqNum);
+#endif